@@ -62,9 +62,20 @@ struct args
 		err:
 			fprintf(stderr,
 			        "usage: " UF
-			        " [ctx]f [-C <dir>] [--lz4] [--one-level] "
-			        "<archive-file> [<directory>]\n",
-			        argv[0]);
+			        " [crtx]f [-C <dir>] [--lz4] [--lz4-blocks] "
+			        "[--one-level] "
+			        "[--walkers <n>] [--jobs <n>] [--io-uring] "
+			        "[--lean] [--dedup] [--direct] "
+			        "[--memory-budget <MiB>] [--name-table] "
+			        "[--child-table] [--digest-order] "
+			        "[--name-filter] [--search-tree] "
+			        "[--previous <archive-file>] "
+			        "<archive-file> [<directory>]\n"
+			        "       " UF " merge [--direct] [--name-table] "
+			        "[--child-table] [--digest-order] "
+			        "[--name-filter] [--search-tree] "
+			        "<archive-file> <input-archive>...\n",
+			        argv[0], argv[0]);
 			exit(2);
 		}
 
@@ -86,8 +97,57 @@ struct args
 				else if (vp == U("--lz4"))
 					opts.feat =
 					    lip::feature::lz4_compressed;
+				else if (vp == U("--lz4-blocks"))
+					opts.feat =
+					    lip::feature::lz4_compressed |
+					    lip::feature::lz4_blocks;
 				else if (vp == U("--one-level"))
 					opts.one_level = true;
+				else if (vp == U("--lean"))
+					opts.lean = true;
+				else if (vp == U("--dedup"))
+					opts.packing.dedup = true;
+				else if (vp == U("--direct"))
+					opts.packing.direct_io = true;
+				else if (vp == U("--name-table"))
+					opts.packing.name_table = true;
+				else if (vp == U("--child-table"))
+					opts.packing.child_table = true;
+				else if (vp == U("--digest-order"))
+					opts.packing.digest_order = true;
+				else if (vp == U("--name-filter"))
+					opts.packing.name_filter = true;
+				else if (vp == U("--search-tree"))
+					opts.packing.search_tree = true;
+				else if (vp == U("--io-uring"))
+					opts.io_uring = true;
+				else if (vp == U("--previous"))
+				{
+					if (++p == argv + argc)
+						goto err;
+					previous = *p;
+				}
+				else if (vp == U("--walkers"))
+				{
+					if (++p == argv + argc or
+					    (opts.walkers = to_count(*p)) < 0)
+						goto err;
+				}
+				else if (vp == U("--memory-budget"))
+				{
+					int mib;
+					if (++p == argv + argc or
+					    (mib = to_count(*p)) < 0)
+						goto err;
+					opts.packing.memory_budget =
+					    size_t(mib) * 1024 * 1024;
+				}
+				else if (vp == U("--jobs"))
+				{
+					if (++p == argv + argc or
+					    (opts.packing.jobs = to_count(*p)) < 0)
+						goto err;
+				}
 				else
 					goto err;
 			}
@@ -98,16 +158,35 @@ struct args
 		archive_file = *p;
 		++p;
 		directory = *p;
+		inputs = p;
+		inputs_end = argv + argc;
+	}
+
+	static int to_count(view_type s)
+	{
+		int n = 0;
+		if (s.empty() or s.size() > 4)
+			return -1;
+		for (auto c : s)
+		{
+			if (c < U('0') or c > U('9'))
+				return -1;
+			n = n * 10 + (c - U('0'));
+		}
+		return n;
 	}
 
 	view_type cmd;
 	lip::archive_options opts;
-	param_type cd = nullptr, archive_file, directory;
+	param_type cd = nullptr, previous = nullptr, archive_file, directory;
+	param_type *inputs, *inputs_end;
 };
 
 static void create(param_type filename, param_type dirname,
-                   lip::archive_options);
+                   lip::archive_options, param_type previous = nullptr);
 static void list(param_type filename);
+static void merge(param_type filename, param_type* first, param_type* last,
+                  lip::packer_options);
 
 #ifdef _WIN32
 int wmain(int argc, wchar_t* argv[])
@@ -124,7 +203,24 @@ int main(int argc, char* argv[])
 			if (a.directory == nullptr)
 				throw command_error{ a.cmd,
 					             "missing directory" };
-			create(a.archive_file, a.directory, a.opts);
+			create(a.archive_file, a.directory, a.opts,
+			       a.previous);
+		}
+		else if (a.cmd == U("rf"))
+		{
+			if (a.directory == nullptr)
+				throw command_error{ a.cmd,
+					             "missing directory" };
+			a.opts.append = true;
+			create(a.archive_file, a.directory, a.opts,
+			       a.previous);
+		}
+		else if (a.cmd == U("merge"))
+		{
+			if (a.inputs == a.inputs_end)
+				throw command_error{ a.cmd, "missing input" };
+			merge(a.archive_file, a.inputs, a.inputs_end,
+			      a.opts.packing);
 		}
 		else if (a.cmd == U("tf"))
 		{
@@ -146,8 +242,58 @@ int main(int argc, char* argv[])
 	}
 }
 
-void create(param_type filename, param_type dirname, lip::archive_options opts)
+#if !defined(_WIN32)
+static int xopen_for_update(char const* filename)
+{
+	auto fd = ::open(filename, O_RDWR);
+	if (fd == -1)
+		throw std::system_error{ errno, std::system_category() };
+	return fd;
+}
+
+// with the permissions fopen would give
+static int xopen_for_create(char const* filename)
 {
+	auto fd = ::open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	if (fd == -1)
+		throw std::system_error{ errno, std::system_category() };
+	return fd;
+}
+#endif
+
+void create(param_type filename, param_type dirname, lip::archive_options opts,
+            param_type previous)
+{
+	if (previous)
+	{
+		auto fd = vvpkg::xopen_for_read(previous);
+		defer(vvpkg::xclose(fd));
+#if !defined(_WIN32)
+		auto st = vvpkg::xfstat(fd);
+		struct stat out;
+		if (::stat(filename, &out) == 0 && out.st_dev == st.st_dev &&
+		    out.st_ino == st.st_ino)
+			throw std::invalid_argument{
+				"cannot overwrite the previous archive"
+			};
+#endif
+		lip::index idx(fd);
+		opts.previous = { &idx, vvpkg::from_seekable_descriptor(fd),
+			          fd };
+		return create(filename, dirname, opts);
+	}
+
+#if !defined(_WIN32)
+	if (filename == view_type(U("-")))
+		lip::archive(vvpkg::xstdout_fileno(), dirname, opts);
+	else
+	{
+		auto fd = opts.append ? xopen_for_update(filename)
+		                      : xopen_for_create(filename);
+		defer(vvpkg::xclose(fd));
+		lip::archive(fd, dirname, opts);
+	}
+#else
 	FILE* fp;
 	std::unique_ptr<FILE, vvpkg::c_file_deleter> to_open;
 
@@ -163,6 +309,53 @@ void create(param_type filename, param_type dirname, lip::archive_options opts)
 	}
 
 	lip::archive(vvpkg::to_c_file(fp), dirname, opts);
+#endif
+}
+
+void merge(param_type filename, param_type* first, param_type* last,
+           lip::packer_options opts)
+{
+#if !defined(_WIN32)
+	struct input
+	{
+		int fd;
+		lip::index idx;
+	};
+	std::vector<std::unique_ptr<input>> v;
+	defer(for (auto&& in : v) vvpkg::xclose(in->fd));
+	struct stat out;
+	bool out_exists = ::stat(filename, &out) == 0;
+	for (auto it = first; it != last; ++it)
+	{
+		auto fd = vvpkg::xopen_for_read(*it);
+		auto guard = stdex::make_guard([=] { vvpkg::xclose(fd); });
+		auto st = vvpkg::xfstat(fd);
+		if (out_exists && out.st_dev == st.st_dev &&
+		    out.st_ino == st.st_ino)
+			throw std::invalid_argument{
+				"cannot overwrite an input archive"
+			};
+		v.push_back(std::unique_ptr<input>(
+		    new input{ fd, lip::index(fd) }));
+		guard.dismiss();
+	}
+
+	std::vector<decltype(vvpkg::from_seekable_descriptor(0))> readers;
+	std::vector<lip::stored_archive> inputs;
+	readers.reserve(v.size());
+	for (auto&& in : v)
+	{
+		readers.push_back(vvpkg::from_seekable_descriptor(in->fd));
+		inputs.push_back({ &in->idx, readers.back(), in->fd });
+	}
+
+	auto fd = xopen_for_create(filename);
+	defer(vvpkg::xclose(fd));
+	lip::merge(fd, inputs, opts);
+#else
+	(void)filename, (void)first, (void)last, (void)opts;
+	throw std::invalid_argument{ "merge unsupported" };
+#endif
 }
 
 void list(param_type filename)
@@ -170,14 +363,13 @@ void list(param_type filename)
 	auto idx = [=] {
 		auto fd = vvpkg::xopen_for_read(filename);
 		defer(vvpkg::xclose(fd));
-		return lip::index(vvpkg::from_seekable_descriptor(fd),
-		                  vvpkg::xfstat(fd).st_size, nullptr);
+		return lip::index(fd);
 	}();
 
 	lip::native_gbpath cvt;
 	for (auto&& fc : idx)
 	{
-		cvt.assign(fc.arcname);
+		cvt.assign(idx.name(fc));
 		printf(UF "\n", cvt.data());
 	}
 }
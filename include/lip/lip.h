@@ -28,8 +28,10 @@
 
 #include <stdint.h>
 #include <array>
+#include <vector>
 #include <chrono>
 #include <memory>
+#include <mutex>
 #include <cerrno>
 #include <system_error>
 #include <algorithm>
@@ -61,6 +63,13 @@ enum class feature
 	// if compressed, the sizeopt field contains the original size
 	// if not, the digest field contains a blake2b-224 hash
 	lz4_compressed = 0x10,
+	// the stored data begin with an extent map, see extent; the digest
+	// covers the logical content with holes read as zeros, and size_
+	// holds the original size
+	sparse = 0x20,
+	// with lz4_compressed, the blocks are compressed independently and
+	// followed by their offsets in the entry and their count, all int64_t
+	lz4_blocks = 0x40,
 	executable = 0x100,
 	readonly = 0x200,  // unimplemented
 };
@@ -112,6 +121,8 @@ union finfo
 {
 	static constexpr int type_mask = 0xf;
 	static constexpr int rep_mask = 0xff;
+	static constexpr int compression_mask =
+	    int(feature::lz4_compressed) | int(feature::lz4_blocks);
 
 	struct
 	{
@@ -126,6 +137,15 @@ union finfo
 	};
 };
 
+// The stored data of a sparse file are an int64_t count, that many
+// extents in ascending order, and the data of the extents; the rest of
+// the file are holes.
+struct extent
+{
+	int64_t offset;
+	int64_t length;
+};
+
 struct fcard
 {
 	union
@@ -150,6 +170,8 @@ struct fcard
 	{
 		if (is_lz4_compressed())
 			return info.sizeopt;
+		else if (is_sparse())
+			return size_;
 		else
 			return stored_size();
 	}
@@ -164,6 +186,16 @@ struct fcard
 		return (info.flag & int(feature::lz4_compressed)) != 0;
 	}
 
+	bool has_lz4_blocks() const
+	{
+		return (info.flag & int(feature::lz4_blocks)) != 0;
+	}
+
+	bool is_sparse() const
+	{
+		return (info.flag & int(feature::sparse)) != 0;
+	}
+
 	bool is_executable() const
 	{
 		return (info.flag & int(feature::executable)) != 0;
@@ -178,15 +210,231 @@ struct header
 	int32_t epoch = 584755;
 };
 
+// Optional sections at the start of bss, ahead of the names, present if
+// bss begins with this header.  Names are addressed by offset, so readers
+// unaware of the extension skip it.
+struct extension_header
+{
+	char magic[8] = { '\0', '\0', 'L', 'I', 'P', 'X', '\0', '\0' };
+	int64_t size;   // including the section table, a multiple of 8
+	int64_t count;  // of the sections that follow
+};
+
+enum class section_tag : uint32_t
+{
+	lz4_digests = 1,  // lz4_digest
+	name_table = 2,   // name_slot
+	child_table = 3,  // uint32_t
+	digest_order = 4,  // uint32_t
+	name_filter = 5,   // filter_block
+	search_tree = 6,   // search_node
+	file_status = 7,   // file_status
+};
+
+struct section
+{
+	section_tag tag;
+	uint32_t reserved;
+	int64_t offset;  // from the extension header, a multiple of 8
+	int64_t size;
+};
+
+// the digest of the original content of a compressed entry, by the
+// position of the entry in the index
+struct lz4_digest
+{
+	uint32_t entry;
+	fhash digest;
+};
+
+static_assert(sizeof(lz4_digest) == 32, "unsupported");
+
+// the file a regular file entry was read from, by the position of the
+// entry in the index, see previous_archive
+struct file_status
+{
+	uint32_t entry;
+	uint32_t reserved;
+	uint64_t device;
+	uint64_t inode;
+	ftime ctime;
+};
+
+static_assert(sizeof(file_status) == 32, "unsupported");
+
+// FNV-1a of an arcname, as used by the name table
+inline uint64_t arcname_hash(string_view s) noexcept
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (char c : s)
+		h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+	return h;
+}
+
+// The name table has a power of two slots, at least twice as many as the
+// entries.  An entry goes to the slot at the low bits of the hash of its
+// arcname, or the first free one after it.
+struct name_slot
+{
+	uint32_t hash;   // the high bits of the hash
+	uint32_t entry;  // the position in the index plus 1, 0 if free
+};
+
+static_assert(sizeof(name_slot) == 8, "unsupported");
+
+// The name filter is a Bloom filter of 64-byte blocks.  An arcname
+// whose hash is h sets six bits in block (h >> 32) * blocks >> 32, see
+// filter_bits.
+struct filter_block
+{
+	uint64_t words[8];
+};
+
+static_assert(sizeof(filter_block) == 64, "unsupported");
+
+inline size_t filter_block_of(uint64_t h, size_t blocks) noexcept
+{
+	return size_t((h >> 32) * blocks >> 32);
+}
+
+// adds to mask the bits of the block an arcname of hash h sets, taken
+// from 9-bit fields of the hash multiplied by an odd constant
+inline void filter_bits(uint64_t h, filter_block& mask) noexcept
+{
+	auto g = h * 0x9e3779b97f4a7c15;
+	for (int i = 0; i < 6; ++i, g >>= 9)
+		mask.words[(g >> 6) & 7] |= uint64_t(1) << (g & 63);
+}
+
+// The search tree of an index of N entries holds N + 1 nodes, of which
+// node 0 is unused and node k has children 2k and 2k + 1, so that an
+// in-order walk from node 1 visits the entries sorted by name.  A node
+// records the length of the prefix its arcname shares with the arcname
+// of its parent (0 at the root), and the 8 bytes that follow it as key.
+struct search_node
+{
+	uint64_t key;
+	uint32_t offset;
+	uint32_t entry;
+};
+
+static_assert(sizeof(search_node) == 16, "unsupported");
+
+// the 8 bytes of name from offset on, zero-padded, as a big-endian number
+inline uint64_t search_key(string_view name, size_t offset) noexcept
+{
+	uint64_t x = 0;
+	for (auto i = offset; i != offset + 8; ++i)
+		x = x << 8 | (i < name.size()
+		                  ? static_cast<unsigned char>(name[i])
+		                  : 0u);
+	return x;
+}
+
+// The child table of an index of N entries begins with N + 2 offsets into
+// the positions that follow, for the top level and then for each entry.
+// Between the offsets of an entry and the next one are the positions of
+// the entries right under it in index order.  Entries whose parent
+// directory is not in the index are under none.
+
+// The digest order holds the positions of the entries with digests, see
+// index::digest, sorted by digest and then by position.
+
+struct packer_options
+{
+	// threads reading and encoding regular files passed to
+	// post_regular_file; their data land in the archive in completion order
+	int jobs = 0;
+	// store the data of uncompressed entries with equal digests once;
+	// a file too large to stage in memory is written and then truncated
+	// away, or kept if the output is not a seekable descriptor
+	bool dedup = false;
+	// of the buffer coalescing small writes to the output, 0 to pass
+	// every write through
+	size_t buffer_size = 4 * 1024 * 1024;
+	// write the descriptor passed to start(int) with O_DIRECT, in blocks
+	// of 4 KiB from its current offset, which must be aligned; the data
+	// of regular files then pass through the buffer, which is rounded
+	// up to whole blocks, instead of being copied by the kernel
+	bool direct_io = false;
+	// bytes of entries to keep in memory, beyond which they are sorted
+	// and spilled to a temporary file in TMPDIR; 0 for no limit.  The
+	// optional sections below and the statuses from set_status are not
+	// covered: finish() builds each of them in memory, at up to a few
+	// dozen bytes per entry.
+	size_t memory_budget = 0;
+	// add a hash table of the arcnames for index::find
+	bool name_table = false;
+	// add the entries under each directory for index::children
+	bool child_table = false;
+	// add the entries sorted by digest for index::find_by_digest
+	bool digest_order = false;
+	// add a Bloom filter of the arcnames, 10 bits per entry, checked by
+	// index::find before searching
+	bool name_filter = false;
+	// add a search tree of name prefixes in Eytzinger order for
+	// index::find
+	bool search_tree = false;
+};
+
+struct packer_stats
+{
+	int64_t bytes_copied = 0;  // moved by the kernel, see file_source
+	int64_t bytes_deduplicated = 0;  // not written, see dedup
+	int64_t bytes_written = 0;  // through the output buffer
+	int64_t flushes = 0;  // writes issued from the output buffer
+};
+
+// A regular file open for reading.  If the packer writes to a descriptor
+// and the entry is not compressed, the data are copied inside the kernel
+// and hashed with pread, or not at all if digest is given; a file written
+// in the meantime is read and hashed again in one pass.  An uncompressed
+// file with holes is stored as a sparse entry.
+struct file_source
+{
+	int fd;
+	fhash const* digest = nullptr;
+};
+
+// An entry of another archive, whose stored data are read by f, or
+// copied inside the kernel from fd if the packer writes to a descriptor.
+struct stored_source
+{
+	fcard const* entry;  // with offsets into the other archive
+	stdex::signature<pread_sig> f;
+	int fd = -1;
+	fhash const* digest = nullptr;  // if compressed, see index::digest
+};
+
+class index;
+
+// Another archive, read by f, or copied inside the kernel from fd if
+// the packer writes to a descriptor.
+struct stored_archive
+{
+	index const* entries;
+	stdex::signature<pread_sig> f;
+	int fd = -1;
+};
+
 class packer
 {
 public:
 	packer();
+	explicit packer(packer_options);
 	packer(packer&&);
 	packer& operator=(packer&&);
 	~packer();
 
 	void start(std::function<write_sig> f);
+	void start(int fd);
+	// Continues the archive in fd, which must begin at offset 0: keeps
+	// its data, lists its entries ahead of the ones added later, and
+	// writes after the end of the file, leaving the old bss and index
+	// unreferenced.  Until finish() returns, truncating fd to its old
+	// size restores the old archive.  Entries added under an existing
+	// name replace it.
+	void resume(int fd);
 	void add_directory(string_view arcname, ftime mtime, __off_t  msize,
                        __uid_t uid, __gid_t gid, __mode_t permissions);
 	void add_symlink(string_view arcname, ftime mtime, string_view target, __off_t  msize,
@@ -194,12 +442,39 @@ public:
 	void add_regular_file(string_view arcname, ftime mtime, __off_t  msize,
                           __uid_t uid, __gid_t gid, __mode_t permissions,
 	                      stdex::signature<refill_sig>, feature = {});
+	void add_regular_file(string_view arcname, ftime mtime, __off_t msize,
+	                      __uid_t uid, __gid_t gid, __mode_t permissions,
+	                      file_source, feature = {});
+	// keeps the digest or the original size of the entry and whether it
+	// is sparse; the compression in feature must be the entry's
+	void add_regular_file(string_view arcname, ftime mtime, __off_t msize,
+	                      __uid_t uid, __gid_t gid, __mode_t permissions,
+	                      stored_source, feature = {});
+	void post_regular_file(string_view arcname, ftime mtime, __off_t msize,
+	                       __uid_t uid, __gid_t gid, __mode_t permissions,
+	                       std::function<refill_sig>, feature = {});
+	// a regular file sharing the data and digest of an entry added earlier
+	void add_hardlink(string_view arcname, string_view existing,
+	                  ftime mtime, __off_t msize, __uid_t uid, __gid_t gid,
+	                  __mode_t permissions);
+	// all entries of another archive, replacing those added earlier under
+	// the same names; adjacent data are copied in one piece, and with
+	// dedup, data already written are not copied again
+	void add_archive(stored_archive);
+	// records the file that the entry under arcname is read from, for a
+	// later archive() to tell whether it was replaced or changed
+	void set_status(string_view arcname, uint64_t device, uint64_t inode,
+	                ftime ctime);
+
+	auto stats() const -> packer_stats;
 
 	void finish()
 	{
+		drain(0);
 		write_bss();
 		write_index();
 		write_section_pointers();
+		flush();
 	}
 
 private:
@@ -216,26 +491,26 @@ private:
 		    sizeof(v));
 	}
 
-	size_t write_buffer(char const* p, size_t sz)
-	{
-		if (write_(p, sz) != sz)
-			throw std::system_error{ errno,
-				                 std::system_category() };
-		return sz;
-	}
+	size_t write_buffer(char const* p, size_t sz);
+	void flush();
 
+	void drain(size_t limit);
+	bool add_sparse_file(string_view arcname, ftime mtime, __uid_t uid,
+	                     __gid_t gid, __mode_t permissions, int fd,
+	                     int64_t size, uint32_t flag);
+	auto put(finfo const& info, char const* p, size_t sz)
+	    -> std::pair<ptr, ptr>;
 	void write_bss();
 	void write_index();
 	void write_section_pointers();
 
 	ptr new_literal(string_view arcname);
 
-	std::function<write_sig> write_;
 	ptr cur_ = {};
 	std::unique_ptr<impl> impl_;
 };
 
-static string_view removeDirName(string_view str)
+inline string_view removeDirName(string_view str)
 {
     auto pos = str.find("/");
     if(pos == str.size() - 1)
@@ -253,6 +528,10 @@ public:
 	using iterator = fcard const*;
 
 	explicit index(stdex::signature<pread_sig> f, int64_t filesize, ptr* pointers);
+	// Maps the bss and the index of the archive in fd, which must begin at
+	// offset 0, rather than reading them.  Opening takes constant time,
+	// but the names of the fcards stay offsets; see name().
+	explicit index(int fd, ptr* pointers = nullptr);
 
 	iterator begin() const { return first_; }
 	iterator end() const { return last_; }
@@ -270,31 +549,140 @@ public:
 
     iterator find(string_view arcname) const
     {
-        auto it =
-                std::lower_bound(begin(), end(), arcname,
-                                 [](fcard const& fc, string_view target) {
-                                     return fc.arcname < target;
-                                 });
-        if (it != end() && it->arcname == arcname)
-            return it;
+        if (slots_ || filter_)
+            return find_hashed(arcname);
         else
-            return end();
+            return search(arcname);
     }
 
-    iterator find_by_name(string_view arcname) const
-    {
-        string_view marcname = removeDirName(arcname);
-        auto it = std::find_if(begin(), end(),
-                  [=](fcard const& fc)
-                  {
-                      return removeDirName(fc.arcname) == marcname;
-                  });
-        return it;
-    }
+	// false if the name filter rules arcname out
+	bool may_contain(string_view arcname) const
+	{
+		return !filter_ || in_filter(arcname_hash(arcname));
+	}
+
+	// the digest of the original content of a regular file or symlink,
+	// if recorded
+	fhash const* digest(fcard const& fc) const;
+
+	// the file a regular file entry was read from, if recorded
+	file_status const* status(fcard const& fc) const;
+
+	// the arcname of an entry of either kind of index
+	char const* name(fcard const& fc) const
+	{
+		return reinterpret_cast<char const*>(names_ + fc.name.offset);
+	}
+
+	// the entries whose arcnames begin with dir and a slash, or all of
+	// them if dir is empty
+	auto subtree(string_view dir) const -> std::pair<iterator, iterator>;
+
+	// entries by their positions, see children() and find_by_digest()
+	class subset
+	{
+	public:
+		struct iterator
+		{
+			fcard const* base;
+			uint32_t const* pos;
+
+			fcard const& operator*() const { return base[*pos]; }
+			fcard const* operator->() const { return base + *pos; }
+			iterator& operator++()
+			{
+				++pos;
+				return *this;
+			}
+			bool operator==(iterator x) const { return pos == x.pos; }
+			bool operator!=(iterator x) const { return pos != x.pos; }
+		};
+
+		subset() = default;
+		subset(subset&&) = default;
+		subset& operator=(subset&&) = default;
+
+		iterator begin() const { return { base_, first_ }; }
+		iterator end() const { return { base_, last_ }; }
+		size_t size() const { return size_t(last_ - first_); }
+		bool empty() const { return first_ == last_; }
+
+	private:
+		friend class index;
+
+		fcard const* base_ = nullptr;
+		uint32_t const *first_ = nullptr, *last_ = nullptr;
+		std::vector<uint32_t> found_;  // if not from a section
+	};
+
+	// the entries right under dir by name, whether dir is a directory,
+	// another entry or none, or at the top level if dir is empty; with a
+	// child table and dir a directory, in time proportional to their
+	// number, otherwise to the size of subtree(dir)
+	subset children(string_view dir) const;
+
+	// the entries whose digests equal d in index order; with a digest
+	// order, by interpolation search, otherwise by a scan
+	subset find_by_digest(fhash const& d) const;
+
+	// the first entry whose arcname matches arcname after removeDirName;
+	// the first call sorts the positions of the entries by those names
+	iterator find_by_name(string_view arcname) const;
 
 private:
-	fcard *first_, *last_;
+	auto section(section_tag) const -> string_view;
+	void find_extension(char const* bss, int64_t size);
+	iterator find_hashed(string_view arcname) const;
+	bool in_filter(uint64_t h) const;
+
+	iterator find_in_tree(string_view arcname) const;
+
+	iterator search(string_view arcname) const
+	{
+		if (tree_)
+			return find_in_tree(arcname);
+
+		auto it = std::lower_bound(
+		    begin(), end(), arcname,
+		    [&](fcard const& fc, string_view target) {
+			    return name(fc) < target;
+		    });
+		if (it != end() && name(*it) == arcname)
+			return it;
+		else
+			return end();
+	}
+
+	struct unmapper
+	{
+		size_t len;
+		void operator()(char* p) const noexcept;
+	};
+
+	fcard const *first_, *last_;
 	std::unique_ptr<char[]> bp_;
+	std::unique_ptr<char, unmapper> map_;
+	// added to the names of the fcards, which are either resolved or
+	// offsets into the mapping
+	intptr_t names_ = 0;
+	extension_header const* ext_ = nullptr;
+	name_slot const* slots_ = nullptr;
+	uint64_t slot_mask_ = 0;
+	uint32_t const* children_ = nullptr;
+	size_t children_size_ = 0;
+	uint32_t const* by_digest_ = nullptr;
+	size_t by_digest_size_ = 0;
+	filter_block const* filter_ = nullptr;
+	size_t filter_blocks_ = 0;
+	search_node const* tree_ = nullptr;
+
+	// positions of the entries sorted by removeDirName, see find_by_name
+	struct name_order
+	{
+		std::once_flag sorted;
+		std::vector<uint32_t> positions;
+	};
+	std::unique_ptr<name_order> by_root_name_{ new name_order };
 };
 
 class content
@@ -315,7 +703,15 @@ public:
 		return s;
 	}
 
+	// decodes compressed entries and fills the holes of sparse ones
 	void copy(fcard const& fc, stdex::signature<write_sig>) &&;
+	// starts at an offset in the file; an entry with lz4_blocks is read
+	// from the block holding it
+	void copy(fcard const& fc, int64_t from,
+	          stdex::signature<write_sig>) &&;
+	// copies to a file at its current offset, leaving holes in it
+	// rather than zeros for a sparse entry
+	void extract(fcard const& fc, int fd) &&;
 
 private:
 	stdex::signature<pread_sig> f_;
@@ -363,14 +759,53 @@ private:
 	std::unique_ptr<impl> impl_;
 };
 
+// A previous archive of the same tree.  Regular files whose names,
+// sizes and modification times are unchanged, and that are still the
+// files recorded by set_status with the same status change times, are
+// copied from it.
+struct previous_archive
+{
+	index const* entries = nullptr;
+	std::function<pread_sig> read;
+	int fd = -1;  // see stored_source
+};
+
 struct archive_options
 {
 	bool one_level = false;
 	feature feat = {};
+	int walkers = 0;  // threads listing directories ahead of the packer
+	bool io_uring = false;  // batch stat and small file reads if possible
+	// statx and getdents64 with large buffers, executable bit taken from
+	// st_mode, files read no further than their stat size
+	bool lean = false;
+	packer_options packing = {};
+	previous_archive previous = {};
+	// extend the archive in fd, see packer::resume; files unchanged since
+	// they were added, as in previous_archive, are not stored again, and
+	// the archive is truncated back to its old size if anything fails
+	bool append = false;
+};
+
+struct archive_stats
+{
+	int64_t entries = 0;
+	int64_t syscalls_avoided = 0;
+	int64_t hardlinks = 0;  // files not read again, see add_hardlink
+	// files copied from the previous archive or kept in the one appended
+	int64_t unchanged = 0;
+	packer_stats packing = {};
 };
 
-void archive(std::function<write_sig>, gbpath::param_type src,
-             archive_options = {});
+archive_stats archive(std::function<write_sig>, gbpath::param_type src,
+                      archive_options = {});
+// Writing to a descriptor lets uncompressed files skip user space.
+archive_stats archive(int fd, gbpath::param_type src, archive_options = {});
+
+// Combines archives into one written to fd; of the entries under the same
+// name, the one from the last archive is kept.  Implies dedup.
+packer_stats merge(int fd, std::vector<stored_archive> const& inputs,
+                   packer_options = {});
 }
 
 #endif
@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_COALESCING__WRITER_H
+#define _LIP_SRC_COALESCING__WRITER_H
+
+#include "kernel_copy.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#include <fcntl.h>
+#endif
+
+namespace lip
+{
+namespace io
+{
+
+#if !defined(_WIN32)
+// makes the writes to fd skip the page cache
+inline void bypass_cache(int fd)
+{
+#if defined(O_DIRECT)
+	auto flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+		throw std::system_error{ errno, std::system_category() };
+#elif defined(F_NOCACHE)
+	if (fcntl(fd, F_NOCACHE, 1) == -1)
+		throw std::system_error{ errno, std::system_category() };
+#endif
+}
+#endif
+
+// Collects small writes in an aligned buffer and passes them on in writes
+// of the buffer's capacity; a write larger than the buffer goes out
+// together with what is buffered.  Writes to a descriptor with writev,
+// which leaves the file offset where copy_upto expects it.
+class coalescing_writer
+{
+public:
+	static constexpr size_t alignment = 4096;
+
+	explicit coalescing_writer(size_t capacity)
+	    : buf_(capacity ? static_cast<char*>(::operator new[](
+	                          capacity, std::align_val_t(alignment)))
+	                    : nullptr),
+	      cap_(capacity)
+	{
+	}
+
+	void target(int fd) { fd_ = fd; }
+	void target(std::function<write_sig> f) { f_ = std::move(f); }
+
+#if !defined(_WIN32)
+	// Writes to fd from offset with pwrite in whole blocks of alignment
+	// bytes, so that fd may be open with O_DIRECT.  A flush pads the last
+	// block and truncates the file to the bytes written; the block is
+	// written again as it fills.
+	void target_direct(int fd, int64_t offset)
+	{
+		if (offset % int64_t(alignment) != 0 || cap_ == 0 ||
+		    cap_ % alignment != 0)
+			throw std::invalid_argument{ "misaligned direct output" };
+		fd_ = fd;
+		pos_ = offset;
+	}
+#endif
+
+	void write(char const* p, size_t sz)
+	{
+		if (sz == 0)
+			return;
+		else if (sz <= cap_ - used_)
+		{
+			memcpy(buf_.get() + used_, p, sz);
+			used_ += sz;
+			return;
+		}
+		else if (sz >= cap_ && pos_ == -1)
+		{
+			emit(buf_.get(), used_, p, sz);
+			used_ = 0;
+			return;
+		}
+
+		while (sz != 0)
+		{
+			auto n = std::min(sz, cap_ - used_);
+			memcpy(buf_.get() + used_, p, n);
+			used_ += n;
+			p += n;
+			sz -= n;
+			if (used_ == cap_)
+			{
+				emit(buf_.get(), cap_, nullptr, 0);
+				used_ = 0;
+			}
+		}
+	}
+
+	void flush()
+	{
+		if (used_ == 0)
+			return;
+		else if (pos_ == -1)
+		{
+			emit(buf_.get(), used_, nullptr, 0);
+			used_ = 0;
+			return;
+		}
+
+#if !defined(_WIN32)
+		auto whole = used_ / alignment * alignment;
+		auto padded = (used_ + alignment - 1) / alignment * alignment;
+		memset(buf_.get() + used_, 0, padded - used_);
+		pwrite_fully(buf_.get(), padded);
+		bytes_written_ += int64_t(used_ - counted_);
+		++flushes_;
+		if (padded != whole &&
+		    ftruncate(fd_, pos_ + int64_t(used_)) == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+
+		counted_ = used_ - whole;
+		memmove(buf_.get(), buf_.get() + whole, counted_);
+		pos_ += int64_t(whole);
+		used_ = counted_;
+#endif
+	}
+
+	int64_t bytes_written() const { return bytes_written_; }
+	int64_t flushes() const { return flushes_; }
+
+private:
+	struct aligned_delete
+	{
+		void operator()(char* p) const
+		{
+			::operator delete[](p, std::align_val_t(alignment));
+		}
+	};
+
+	void emit(char const* p, size_t sz, char const* q, size_t qsz)
+	{
+		if (sz + qsz == 0)
+			return;
+		if (fd_ == -1)
+		{
+			for (auto x : { string_view(p, sz), string_view(q, qsz) })
+			{
+				if (x.empty())
+					continue;
+				if (f_(x.data(), x.size()) != x.size())
+					throw std::system_error{
+						errno, std::system_category()
+					};
+				++flushes_;
+			}
+		}
+#if !defined(_WIN32)
+		else if (pos_ != -1)
+		{
+			pwrite_fully(p, sz);
+			pos_ += int64_t(sz);
+			++flushes_;
+		}
+#endif
+		else
+		{
+			writev_fully(p, sz, q, qsz);
+			++flushes_;
+		}
+		bytes_written_ += int64_t(sz + qsz - counted_);
+		counted_ = 0;
+	}
+
+	void writev_fully(char const* p, size_t sz, char const* q,
+	                  size_t qsz)
+	{
+#if !defined(_WIN32)
+		iovec iov[] = { { const_cast<char*>(p), sz },
+			        { const_cast<char*>(q), qsz } };
+		for (iovec* it = sz ? iov : iov + 1; it != std::end(iov);)
+		{
+			auto n = ::writev(fd_, it, int(std::end(iov) - it));
+			if (n == -1 && errno == EINTR)
+				continue;
+			else if (n == -1)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+			for (auto left = size_t(n); it != std::end(iov);)
+			{
+				if (left < it->iov_len)
+				{
+					it->iov_base =
+					    static_cast<char*>(it->iov_base) +
+					    left;
+					it->iov_len -= left;
+					break;
+				}
+				left -= it->iov_len;
+				++it;
+			}
+		}
+#else
+		if (io::write_fully(fd_, p, sz) != sz ||
+		    io::write_fully(fd_, q, qsz) != qsz)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+#endif
+	}
+
+#if !defined(_WIN32)
+	// writes p at pos_ in as many calls as it takes
+	void pwrite_fully(char const* p, size_t sz)
+	{
+		for (size_t done = 0; done != sz;)
+		{
+			auto n = ::pwrite(fd_, p + done, sz - done,
+			                  pos_ + int64_t(done));
+			if (n == -1 && errno == EINTR)
+				continue;
+			else if (n == -1)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+			done += size_t(n);
+		}
+	}
+#endif
+
+	std::unique_ptr<char[], aligned_delete> buf_;
+	size_t cap_;
+	size_t used_ = 0;
+	int fd_ = -1;
+	std::function<write_sig> f_;
+	int64_t pos_ = -1;  // of the buffer in a direct output
+	size_t counted_ = 0;  // bytes at the front already in bytes_written_
+	int64_t bytes_written_ = 0;
+	int64_t flushes_ = 0;
+};
+
+}
+}
+
+#endif
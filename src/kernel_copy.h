@@ -0,0 +1,239 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_KERNEL__COPY_H
+#define _LIP_SRC_KERNEL__COPY_H
+
+#include <lip/lip.h>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#else
+#include <io.h>
+#endif
+
+namespace lip
+{
+namespace io
+{
+
+// writes all of p unless an error occurs
+inline size_t write_fully(int fd, char const* p, size_t sz)
+{
+	size_t done = 0;
+	while (done != sz)
+	{
+#if defined(_WIN32)
+		auto n = _write(fd, p + done, unsigned(sz - done));
+#else
+		auto n = ::write(fd, p + done, sz - done);
+#endif
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += size_t(n);
+	}
+	return done;
+}
+
+#if !defined(_WIN32)
+
+// The ranges of the first size bytes of fd that hold data according to
+// SEEK_DATA and SEEK_HOLE, or all of them if the file system cannot tell.
+// Leaves the file offset unchanged.
+inline std::vector<extent> data_extents(int fd, int64_t size)
+{
+#if defined(SEEK_DATA)
+	std::vector<extent> v;
+	auto pos = lseek(fd, 0, SEEK_CUR);
+	auto fail = [&](int ec) {
+		lseek(fd, pos, SEEK_SET);
+		throw std::system_error{ ec, std::system_category() };
+	};
+
+	for (off_t off = 0; off < size;)
+	{
+		auto data = lseek(fd, off, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+			break;
+		else if (data == -1 && off == 0 && errno == EINVAL)
+		{
+			v.assign({ { 0, size } });
+			break;
+		}
+		else if (data == -1)
+			fail(errno);
+
+		auto hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1)
+			fail(errno);
+		if (data >= size)
+			break;
+		v.push_back({ data, std::min<int64_t>(hole, size) - data });
+		off = hole;
+	}
+	lseek(fd, pos, SEEK_SET);
+	return v;
+#else
+	return { { 0, size } };
+#endif
+}
+
+// Appends up to len bytes of in_fd from off to out_fd with
+// copy_file_range, falling back to sendfile, and stopping early at the end
+// of file.  Returns the bytes appended, or -1 if neither call works for
+// these descriptors and nothing was written.
+inline int64_t copy_in_kernel(int in_fd, off_t off, int out_fd, int64_t len)
+{
+#if defined(__linux__)
+	int64_t done = 0;
+	for (auto from = off; done != len;)
+	{
+		auto n = copy_file_range(in_fd, &from, out_fd, nullptr,
+		                         size_t(len - done), 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && done == 0 &&
+		         (errno == EXDEV || errno == EINVAL ||
+		          errno == ENOSYS || errno == EOPNOTSUPP ||
+		          errno == EBADF))
+			break;
+		else if (n == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		else if (n == 0)
+			return done;
+		done += n;
+	}
+
+	for (auto from = off_t(off + done); done != len;)
+	{
+		auto n = sendfile(out_fd, in_fd, &from, size_t(len - done));
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && done == 0 &&
+		         (errno == EINVAL || errno == ENOSYS))
+			return -1;
+		else if (n == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		else if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+#else
+	return -1;
+#endif
+}
+
+// Appends up to len bytes of in_fd from off to out_fd without passing them
+// through user space if the kernel can, falling back to pread, and stopping
+// early at the end of file.  Returns the bytes appended, and adds to
+// by_kernel the ones moved by the kernel.
+inline int64_t copy_upto(int in_fd, int64_t off, int out_fd, int64_t len,
+                         int64_t& by_kernel)
+{
+	auto copied = copy_in_kernel(in_fd, off_t(off), out_fd, len);
+	if (copied != -1)
+	{
+		by_kernel += copied;
+		return copied;
+	}
+
+	constexpr size_t bufsize = 64 * 1024;
+	std::unique_ptr<char[]> buf(new char[bufsize]);
+	int64_t done = 0;
+	while (done != len)
+	{
+		auto n = ::pread(in_fd, buf.get(),
+		                 size_t(std::min<int64_t>(len - done, bufsize)),
+		                 off + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		else if (n == 0)
+			break;
+		if (write_fully(out_fd, buf.get(), size_t(n)) != size_t(n))
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		done += n;
+	}
+	return done;
+}
+
+// Feeds up to len bytes of fd from off to h, stopping early at the end of
+// file.  Returns the bytes read.
+template <class Hasher>
+inline int64_t hash_upto(Hasher& h, int fd, int64_t off, int64_t len)
+{
+	constexpr size_t bufsize = 64 * 1024;
+	std::unique_ptr<char[]> buf(new char[bufsize]);
+	int64_t done = 0;
+	while (done != len)
+	{
+		auto n = ::pread(fd, buf.get(),
+		                 size_t(std::min<int64_t>(len - done, bufsize)),
+		                 off + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		else if (n == 0)
+			break;
+		h.update(buf.get(), size_t(n));
+		done += n;
+	}
+	return done;
+}
+
+// Appends len bytes of in_fd from off to out_fd like copy_upto, where
+// reaching the end of file first is an error.  Returns the bytes moved by
+// the kernel.
+inline int64_t copy_region(int in_fd, int64_t off, int out_fd, int64_t len)
+{
+	int64_t by_kernel = 0;
+	if (copy_upto(in_fd, off, out_fd, len, by_kernel) != len)
+		throw std::runtime_error{ "racy file access" };
+	return by_kernel;
+}
+
+#endif
+
+}
+}
+
+#endif
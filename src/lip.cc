@@ -24,27 +24,916 @@
  */
 
 #include <lip/lip.h>
-#include <cedar/cedarpp.h>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <stddef.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include <stdex/hashlib.h>
 #include <stdex/oneof.h>
+#include <vvpkg/fd_funcs.h>
 
 #include "raw_pass.h"
 #include "lz4_pass.h"
+#include "kernel_copy.h"
+#include "coalescing_writer.h"
+#include "spill.h"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 
 namespace lip
 {
 
 using hashfn = stdex::hashlib::blake2b_224;
 
+constexpr auto operator|(ftype a, feature b)
+{
+	return uint32_t(a) | uint32_t(b);
+}
+
+struct encoded
+{
+	finfo info;
+	fhash digest;  // of the original content
+};
+
+template <class F>
+static encoded encode(stdex::signature<refill_sig> f, uint32_t flag,
+                      F&& sink)
+{
+	using raw = io::raw_output_pass<hashfn>;
+	using lz4 = io::lz4_output_pass<hashfn>;
+	using lz4_blocks = io::lz4_block_output_pass<hashfn>;
+
+	auto rep = flag & finfo::compression_mask;
+	auto pass = [=]() -> stdex::oneof<raw, lz4, lz4_blocks> {
+		if (rep == finfo::compression_mask)
+			return lz4_blocks{};
+		else if (rep == int(feature::lz4_compressed))
+			return lz4{};
+		else
+			return raw{};
+	}();
+
+	for (error_code ec;;)
+	{
+		auto r = pass.match(
+		    [&](auto& x) { return x.make_available(f, ec); });
+		if (ec)
+			throw std::system_error{ ec };
+		else if (r.nbytes == 0)
+			break;
+
+		sink(r.ptr, r.nbytes);
+	}
+
+	auto info = pass.match([](auto& x) { return x.stat(); });
+	info.flag = flag;
+	return { info, pass.match([](auto& x) { return x.digest(); }) };
+}
+
+// NUL-terminated strings in chunks that never move, by offset
+class name_arena
+{
+public:
+	static constexpr size_t chunk_size = 1024 * 1024;
+
+	int64_t add(string_view s)
+	{
+		if (s.size() >= chunk_size)
+			throw std::length_error{ "arcname too long" };
+		if (chunk_size - used_ <= s.size())
+		{
+			chunks_.emplace_back(new char[chunk_size]);
+			used_ = 0;
+		}
+
+		auto p = chunks_.back().get() + used_;
+		memcpy(p, s.data(), s.size());
+		p[s.size()] = '\0';
+		auto off = (chunks_.size() - 1) * chunk_size + used_;
+		used_ += s.size() + 1;
+		return int64_t(off);
+	}
+
+	char const* operator[](int64_t off) const
+	{
+		return chunks_[size_t(off) / chunk_size].get() +
+		       size_t(off) % chunk_size;
+	}
+
+	void clear()
+	{
+		decltype(chunks_)().swap(chunks_);
+		used_ = chunk_size;
+	}
+
+	// the bytes taken by the strings
+	size_t size() const
+	{
+		return chunks_.empty() ? 0
+		                       : (chunks_.size() - 1) * chunk_size + used_;
+	}
+
+private:
+	std::vector<std::unique_ptr<char[]>> chunks_;
+	size_t used_ = chunk_size;
+};
+
 struct packer::impl
 {
-	cedar::da<int> m;
+	struct job
+	{
+		std::string arcname;
+		ftime mtime;
+		__off_t msize;
+		__uid_t uid;
+		__gid_t gid;
+		__mode_t permissions;
+		std::function<refill_sig> f;
+		uint32_t flag;
+		std::string data;
+		finfo info;
+		fhash digest;
+		std::exception_ptr error;
+	};
+
+	struct region
+	{
+		ptr begin, end;
+	};
+
+	struct digest_hash
+	{
+		size_t operator()(fhash const& h) const noexcept
+		{
+			size_t x;
+			memcpy(&x, h.data(), sizeof(x));
+			return x;
+		}
+	};
+
+	// arcnames at the offsets held by the names of their fcards until
+	// write_bss
+	name_arena names;
 	std::vector<fcard> v;
+	// positions in v in the order of the index; of the entries added
+	// under the same name, the last one is kept
+	std::vector<uint32_t> order;
+	// of the hashes of arcnames to positions in v, built once needed
+	std::unordered_multimap<size_t, uint32_t> by_name;
+	bool by_name_ready = false;
 	int64_t bss_size = 0;
+	int out_fd = -1;
+	int64_t out_base = -1;  // where the archive starts in a seekable out_fd
+	packer_stats stats;
+	bool dedup;
+	bool direct;
+	std::unordered_map<fhash, region, digest_hash> regions;
+	// of sparse entries, by the hash of their extents and digest, as
+	// the same content may be laid out differently
+	std::unordered_map<fhash, region, digest_hash> sparse_regions;
+	// of the original content of compressed entries, by position in v
+	std::unordered_map<size_t, fhash> lz4_digests;
+	bool digests_kept = false;
+	// of the files behind entries, by arcname, see set_status
+	std::unordered_map<std::string, file_status> statuses;
+	// sorted runs of the entries no longer in v, see memory_budget
+	std::unique_ptr<io::spill_file> spilled;
+	size_t memory_budget;
+	bool name_table;
+	bool child_table;
+	bool digest_order;
+	bool name_filter;
+	bool search_tree;
+	ptr names_begin = {};
+	// must be flushed before writing to out_fd directly
+	io::coalescing_writer out;
 
-	static constexpr auto npos = decltype(m)::CEDAR_NO_PATH;
+	std::mutex mu;
+	std::condition_variable work_cv, done_cv;
+	std::deque<std::unique_ptr<job>> todo, done;
+	size_t inflight = 0;
+	bool stop = false;
+	std::vector<std::thread> workers;
+
+	// iterations of a loop shared by the workers and the packer
+	struct loop
+	{
+		std::function<void(size_t)> const* fn;
+		size_t next, n, left;
+	};
+	loop* cur_loop = nullptr;
+
+	// larger files are not staged in memory by the pipeline or dedup
+	static constexpr __off_t staged_size = 4 * 1024 * 1024;
+
+	static size_t block_aligned(size_t n)
+	{
+		constexpr auto x = io::coalescing_writer::alignment;
+		return std::max((n + x - 1) / x * x, x);
+	}
+
+	explicit impl(packer_options const& opts)
+	    : dedup(opts.dedup), direct(opts.direct_io),
+	      memory_budget(opts.memory_budget),
+	      name_table(opts.name_table), child_table(opts.child_table),
+	      digest_order(opts.digest_order), name_filter(opts.name_filter),
+	      search_tree(opts.search_tree),
+	      out(direct ? block_aligned(opts.buffer_size) : opts.buffer_size)
+	{
+		for (int i = 0; i < opts.jobs; ++i)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~impl()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mu);
+			stop = true;
+		}
+		work_cv.notify_all();
+		for (auto& t : workers)
+			t.join();
+	}
+
+	void submit(std::unique_ptr<job> j)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mu);
+			todo.push_back(std::move(j));
+			++inflight;
+		}
+		work_cv.notify_one();
+	}
+
+	bool loop_pending() const
+	{
+		return cur_loop && cur_loop->next != cur_loop->n;
+	}
+
+	// runs one iteration of the current loop with mu held by lk
+	void step(std::unique_lock<std::mutex>& lk)
+	{
+		auto& l = *cur_loop;
+		auto i = l.next++;
+		lk.unlock();
+		(*l.fn)(i);
+		lk.lock();
+		if (--l.left == 0)
+			done_cv.notify_all();
+	}
+
+	// calls fn(0) to fn(n - 1) on the workers and the calling thread
+	void for_each(size_t n, std::function<void(size_t)> const& fn)
+	{
+		loop l = { &fn, 0, n, n };
+		std::unique_lock<std::mutex> lk(mu);
+		cur_loop = &l;
+		work_cv.notify_all();
+		while (loop_pending())
+			step(lk);
+		done_cv.wait(lk, [&] { return l.left == 0; });
+		cur_loop = nullptr;
+	}
+
+	void work()
+	{
+		for (;;)
+		{
+			std::unique_ptr<job> j;
+			{
+				std::unique_lock<std::mutex> lk(mu);
+				work_cv.wait(lk, [&] {
+					return stop || loop_pending() ||
+					       !todo.empty();
+				});
+				if (stop)
+					return;
+				if (loop_pending())
+				{
+					step(lk);
+					continue;
+				}
+				j = std::move(todo.front());
+				todo.pop_front();
+			}
+
+			try
+			{
+				auto r = encode(j->f, j->flag,
+				                [&](char const* p, size_t n) {
+					                j->data.append(p, n);
+				                });
+				j->info = r.info;
+				j->digest = r.digest;
+			}
+			catch (...)
+			{
+				j->error = std::current_exception();
+			}
+			j->f = nullptr;
+
+			{
+				std::lock_guard<std::mutex> lk(mu);
+				done.push_back(std::move(j));
+			}
+			done_cv.notify_one();
+		}
+	}
+
+	// records the digest of the entry just added if it is compressed
+	void keep_digest(fhash const& digest)
+	{
+		if (v.back().is_lz4_compressed())
+		{
+			lz4_digests.emplace(v.size() - 1, digest);
+			digests_kept = true;
+		}
+	}
+
+	static bool dedupable(finfo const& info)
+	{
+		return (info.flag & (int(feature::lz4_compressed) |
+		                     int(feature::sparse))) == 0;
+	}
+
+	// an earlier region holding the data that info describes
+	region const* lookup(finfo const& info) const
+	{
+		if (!dedup || !dedupable(info))
+			return nullptr;
+
+		auto it = regions.find(info.digest);
+		if (it == regions.end())
+			return nullptr;
+		else
+			return &it->second;
+	}
+
+	void remember(finfo const& info, ptr begin, ptr end)
+	{
+		if (dedup && dedupable(info) && end - begin != 0)
+			regions.emplace(info.digest, region{ begin, end });
+	}
+
+	// discards the output from `to` onwards if possible
+	bool rewind(ptr to)
+	{
+#if !defined(_WIN32)
+		if (out_base == -1)
+			return false;
+
+		out.flush();
+		auto off = out_base + to.offset;
+		return ftruncate(out_fd, off) == 0 &&
+		       lseek(out_fd, off, SEEK_SET) == off;
+#else
+		return false;
+#endif
+	}
+
+	// Writes the extension_header and sections to place ahead of the
+	// names, if there is any section to write.  Returns the bytes written.
+	// The lz4_digests section is streamed from the entries; the others
+	// are built in memory, outside of memory_budget.
+	int64_t write_extension()
+	{
+		if (!digests_kept && !name_table && !child_table &&
+		    !digest_order && !name_filter && !search_tree &&
+		    statuses.empty())
+			return 0;
+
+		size_t n = 0, ndigests = 0;
+		std::vector<uint64_t> hashes;
+		// of each entry, the node of its parent, see child_table
+		std::vector<uint32_t> parents;
+		directory_nodes dirs;
+		// of each entry, the length of the prefix its arcname shares
+		// with the previous one
+		std::vector<uint32_t> common;
+		std::string last_name;
+		// of the entries with digests, see index::digest
+		std::vector<std::pair<fhash, uint32_t>> by_digest;
+		std::vector<file_status> found;
+		entries([&](fcard const& fc, string_view name,
+		            fhash const* digest) {
+			ndigests += digest != nullptr;
+			if (!statuses.empty() &&
+			    fc.type() == ftype::is_regular_file)
+			{
+				auto it = statuses.find(
+				    std::string(name.data(), name.size()));
+				if (it != statuses.end())
+				{
+					found.push_back(it->second);
+					found.back().entry = uint32_t(n);
+				}
+			}
+			if (digest_order && fc.type() != ftype::is_directory)
+			{
+				if (digest)
+					by_digest.push_back({ *digest, uint32_t(n) });
+				else if (!fc.is_lz4_compressed())
+					by_digest.push_back(
+					    { fc.info.digest, uint32_t(n) });
+			}
+			if (search_tree)
+			{
+				common.push_back(uint32_t(common_prefix(
+				    name, string_view(last_name))));
+				last_name.assign(name.data(), name.size());
+			}
+			if (name_table || child_table || name_filter)
+			{
+				auto h = arcname_hash(name);
+				if (name_table || name_filter)
+					hashes.push_back(h);
+				if (child_table)
+				{
+					parents.push_back(parent_node(name, dirs));
+					if (fc.type() == ftype::is_directory)
+						dirs.emplace(
+						    h,
+						    std::make_pair(
+						        std::string(name.data(),
+						                    name.size()),
+						        uint32_t(n + 1)));
+				}
+			}
+			++n;
+		});
+
+		struct payload
+		{
+			section_tag tag;
+			size_t size;
+			std::function<void()> write;
+		};
+		std::vector<payload> sections;
+
+		if (ndigests != 0)
+			sections.push_back(
+			    { section_tag::lz4_digests,
+			      ndigests * sizeof(lz4_digest), [&] {
+				      uint32_t i = 0;
+				      entries([&](fcard const&, string_view,
+				                  fhash const* digest) {
+					      if (digest)
+					      {
+						      lz4_digest d = { i, *digest };
+						      out.write(reinterpret_cast<
+						                    char const*>(&d),
+						                sizeof(d));
+					      }
+					      ++i;
+				      });
+			      } });
+
+		std::vector<name_slot> slots;
+		if (name_table && n != 0)
+		{
+			size_t cap = 2;
+			while (cap < 2 * n)
+				cap *= 2;
+			slots.resize(cap);
+			for (size_t i = 0; i != n; ++i)
+			{
+				auto j = size_t(hashes[i]) & (cap - 1);
+				while (slots[j].entry != 0)
+					j = (j + 1) & (cap - 1);
+				slots[j] = { uint32_t(hashes[i] >> 32),
+					     uint32_t(i + 1) };
+			}
+			sections.push_back(
+			    { section_tag::name_table,
+			      cap * sizeof(name_slot), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    slots.data()),
+				                slots.size() * sizeof(name_slot));
+			      } });
+		}
+
+		std::vector<uint32_t> children;
+		if (child_table && n != 0)
+		{
+			children.resize(n + 2);
+			for (auto p : parents)
+				if (p != no_parent)
+					++children[p + 1];
+			std::partial_sum(children.begin(), children.end(),
+			                 children.begin());
+			auto cursor = children;
+			children.resize(n + 2 + children.back());
+			for (size_t i = 0; i != n; ++i)
+				if (parents[i] != no_parent)
+					children[n + 2 + cursor[parents[i]]++] =
+					    uint32_t(i);
+			sections.push_back(
+			    { section_tag::child_table,
+			      children.size() * sizeof(uint32_t), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    children.data()),
+				                children.size() * sizeof(uint32_t));
+			      } });
+		}
+
+		std::vector<filter_block> filter;
+		if (name_filter && n != 0)
+		{
+			filter.resize((n * 10 + 511) / 512);
+			for (auto h : hashes)
+				filter_bits(h, filter[filter_block_of(
+				                   h, filter.size())]);
+			sections.push_back(
+			    { section_tag::name_filter,
+			      filter.size() * sizeof(filter_block), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    filter.data()),
+				                filter.size() * sizeof(filter_block));
+			      } });
+		}
+
+		std::vector<search_node> tree;
+		if (search_tree && n != 0)
+		{
+			tree.resize(n + 1);
+			uint32_t i = 0;
+			for (auto k = first_in_order(n); k != 0;
+			     k = next_in_order(k, n))
+				tree[k].entry = i++;
+			// the prefix two arcnames share is the shortest one
+			// shared by neighbors between them
+			for (size_t k = 2; k <= n; ++k)
+			{
+				auto p = tree[k / 2].entry, q = tree[k].entry;
+				tree[k].offset = *std::min_element(
+				    common.begin() + std::min(p, q) + 1,
+				    common.begin() + std::max(p, q) + 1);
+			}
+			auto k = first_in_order(n);
+			entries([&](fcard const&, string_view name,
+			            fhash const*) {
+				tree[k].key = search_key(name, tree[k].offset);
+				k = next_in_order(k, n);
+			});
+			sections.push_back(
+			    { section_tag::search_tree,
+			      tree.size() * sizeof(search_node), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    tree.data()),
+				                tree.size() * sizeof(search_node));
+			      } });
+		}
+
+		std::vector<uint32_t> digest_positions;
+		if (!by_digest.empty())
+		{
+			std::sort(by_digest.begin(), by_digest.end());
+			for (auto&& x : by_digest)
+				digest_positions.push_back(x.second);
+			sections.push_back(
+			    { section_tag::digest_order,
+			      digest_positions.size() * sizeof(uint32_t), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    digest_positions.data()),
+				                digest_positions.size() *
+				                    sizeof(uint32_t));
+			      } });
+		}
+
+		if (!found.empty())
+			sections.push_back(
+			    { section_tag::file_status,
+			      found.size() * sizeof(file_status), [&] {
+				      out.write(reinterpret_cast<char const*>(
+				                    found.data()),
+				                found.size() * sizeof(file_status));
+			      } });
+
+		if (sections.empty())
+			return 0;
+
+		extension_header h;
+		h.count = int64_t(sections.size());
+		h.size = int64_t(sizeof(h) + sizeof(section) * sections.size());
+		std::vector<section> table;
+		for (auto&& x : sections)
+		{
+			table.push_back({ x.tag, 0, h.size, int64_t(x.size) });
+			h.size += int64_t(padded(x.size));
+		}
+
+		out.write(reinterpret_cast<char const*>(&h), sizeof(h));
+		out.write(reinterpret_cast<char const*>(table.data()),
+		          table.size() * sizeof(section));
+		for (auto&& x : sections)
+		{
+			x.write();
+			out.write("\0\0\0\0\0\0\0", padded(x.size) - x.size);
+		}
+		return h.size;
+	}
+
+	static constexpr uint32_t no_parent = uint32_t(-1);
+
+	// sections begin at multiples of 8 from the extension header
+	static size_t padded(size_t n) { return (n + 7) / 8 * 8; }
+
+	static size_t common_prefix(string_view a, string_view b)
+	{
+		size_t i = 0;
+		while (i < a.size() && i < b.size() && a[i] == b[i])
+			++i;
+		return i;
+	}
+
+	// the first node of the search tree of n entries in order
+	static size_t first_in_order(size_t n)
+	{
+		size_t k = 1;
+		while (2 * k <= n)
+			k *= 2;
+		return k;
+	}
+
+	// the node after k in the search tree of n entries in order, or 0
+	static size_t next_in_order(size_t k, size_t n)
+	{
+		if (2 * k + 1 <= n)
+		{
+			k = 2 * k + 1;
+			while (2 * k <= n)
+				k *= 2;
+			return k;
+		}
+		while (k & 1)
+			k >>= 1;
+		return k >> 1;
+	}
+
+	// the names and nodes of directories by the hashes of their names
+	using directory_nodes =
+	    std::unordered_multimap<uint64_t, std::pair<std::string, uint32_t>>;
+
+	// the node in the child table of the directory holding name, given
+	// the directories seen so far
+	static uint32_t parent_node(string_view name, directory_nodes const& dirs)
+	{
+		auto n = name.size();
+		while (n != 0 && name[n - 1] != '/')
+			--n;
+		if (n == 0)
+			return 0;
+
+		auto parent = name.substr(0, n - 1);
+		auto r = dirs.equal_range(arcname_hash(parent));
+		for (auto it = r.first; it != r.second; ++it)
+			if (string_view(it->second.first) == parent)
+				return it->second.second;
+		return no_parent;
+	}
+
+	// calls fn(fcard, arcname, digest) on the entries of the index in
+	// order; digest is the one kept for a compressed entry, if any
+	template <class F>
+	void entries(F&& fn)
+	{
+		if (spilled)
+			return spilled->merge(
+			    [&](io::spilled_entry const& e, string_view name) {
+				    fn(e.fc, name,
+				       e.has_digest ? &e.digest : nullptr);
+			    });
+
+		for (auto i : order)
+		{
+			auto it = lz4_digests.find(i);
+			fn(v[i], name_of(i),
+			   it == lz4_digests.end() ? nullptr : &it->second);
+		}
+	}
+
+	// readies entries() for write_bss
+	void seal()
+	{
+		if (spilled)
+			spill();
+		else
+			sort_names();
+	}
+
+	size_t memory_used() const
+	{
+		return v.size() * sizeof(fcard) + names.size() +
+		       by_name.size() * (sizeof(size_t) * 2 + 16) +
+		       lz4_digests.size() * (sizeof(size_t) + sizeof(fhash) + 16);
+	}
+
+	// moves the entries in memory to a new sorted run on disk
+	void spill()
+	{
+		sort_names();
+		if (!spilled)
+			spilled.reset(new io::spill_file);
+
+		spilled->begin_run();
+		for (auto i : order)
+		{
+			io::spilled_entry e = { v[i], 0, 0, {} };
+			auto name = string_view(name_of(i));
+			e.name_size = int32_t(name.size());
+			auto it = lz4_digests.find(i);
+			if (it != lz4_digests.end())
+			{
+				e.has_digest = 1;
+				e.digest = it->second;
+			}
+			spilled->append(e, name);
+		}
+		spilled->end_run();
+
+		v.clear();
+		order.clear();
+		names.clear();
+		by_name.clear();
+		by_name_ready = false;
+		lz4_digests.clear();
+	}
+
+	// the latest entry added as arcname
+	bool find_entry(string_view arcname, io::spilled_entry& e)
+	{
+		auto i = find_name(arcname);
+		if (i == -1)
+			return spilled && spilled->find(arcname, e);
+
+		e = { v[size_t(i)], 0, 0, {} };
+		auto it = lz4_digests.find(size_t(i));
+		if (it != lz4_digests.end())
+		{
+			e.has_digest = 1;
+			e.digest = it->second;
+		}
+		return true;
+	}
+
+	char const* name_of(size_t i) const
+	{
+		return names[v[i].name.offset];
+	}
+
+	static size_t name_hash(string_view s)
+	{
+		return std::hash<std::string_view>()(
+		    std::string_view(s.data(), s.size()));
+	}
+
+	// the position in v of the last entry added as arcname, or -1
+	int64_t find_name(string_view arcname)
+	{
+		if (!by_name_ready)
+		{
+			for (size_t i = 0; i < v.size(); ++i)
+				by_name.emplace(name_hash(name_of(i)),
+				                uint32_t(i));
+			by_name_ready = true;
+		}
+
+		int64_t found = -1;
+		auto r = by_name.equal_range(name_hash(arcname));
+		for (auto it = r.first; it != r.second; ++it)
+		{
+			if (name_of(it->second) == arcname)
+				found = std::max(found, int64_t(it->second));
+		}
+		return found;
+	}
+
+	struct name_key
+	{
+		char const* name;
+		uint32_t pos;
+	};
+
+	// Sorts the keys bytewise by their names from depth d with an
+	// in-place MSD radix sort; names ending at d stay in front.
+	static void sort_names(name_key* first, name_key* last, size_t d)
+	{
+		for (;;)
+		{
+			if (last - first < 64)
+			{
+				std::sort(first, last, [d](auto& a, auto& b) {
+					return strcmp(a.name + d, b.name + d) < 0;
+				});
+				return;
+			}
+
+			size_t bucket[257];
+			if (!distribute(first, last, d, bucket))
+			{
+				if (first->name[d] == '\0')
+					return;
+				d += common_prefix(first, last, d);
+				continue;
+			}
+
+			for (size_t c = 1; c < 256; ++c)
+				sort_names(first + bucket[c], first + bucket[c + 1],
+				           d + 1);
+			return;
+		}
+	}
+
+	// the length of the prefix the names share from depth d
+	static size_t common_prefix(name_key* first, name_key* last, size_t d)
+	{
+		auto s = first->name + d;
+		auto n = strlen(s);
+		for (auto it = first + 1; it != last && n != 0; ++it)
+		{
+			auto t = it->name + d;
+			size_t i = 0;
+			while (i < n && s[i] == t[i])
+				++i;
+			n = i;
+		}
+		return n;
+	}
+
+	// permutes the keys into the buckets of their bytes at depth d,
+	// whose bounds land in bucket, unless they all share the byte
+	static bool distribute(name_key* first, name_key* last, size_t d,
+	                       size_t (&bucket)[257])
+	{
+		auto byte = [d](name_key const& k) {
+			return size_t(static_cast<unsigned char>(k.name[d]));
+		};
+
+		size_t count[256] = {};
+		for (auto it = first; it != last; ++it)
+			++count[byte(*it)];
+		if (count[byte(*first)] == size_t(last - first))
+			return false;
+
+		bucket[0] = 0;
+		for (size_t c = 0; c < 256; ++c)
+			bucket[c + 1] = bucket[c] + count[c];
+		size_t next[256];
+		std::copy_n(bucket, 256, next);
+		for (size_t c = 0; c < 256; ++c)
+		{
+			while (next[c] != bucket[c + 1])
+			{
+				auto b = byte(first[next[c]]);
+				if (b == c)
+					++next[c];
+				else
+					std::swap(first[next[c]], first[next[b]++]);
+			}
+		}
+		return true;
+	}
+
+	// fills order, sorting the buckets of the first byte in parallel
+	void sort_names()
+	{
+		std::vector<name_key> keys(v.size());
+		for (size_t i = 0; i < v.size(); ++i)
+			keys[i] = { name_of(i), uint32_t(i) };
+
+		size_t bucket[257];
+		auto first = keys.data(), last = first + keys.size();
+		if (keys.empty() || !distribute(first, last, 0, bucket))
+			sort_names(first, last, 0);
+		else
+			for_each(255, [&](size_t i) {
+				sort_names(first + bucket[i + 1],
+				           first + bucket[i + 2], 1);
+			});
+
+		order.clear();
+		order.reserve(keys.size());
+		for (auto it = first; it != last; ++it)
+		{
+			if (!order.empty() &&
+			    strcmp(name_of(order.back()), it->name) == 0)
+				order.back() = std::max(order.back(), it->pos);
+			else
+				order.push_back(it->pos);
+		}
+	}
 
 	ptr get_bes(ptr base) const { return { base.offset + bss_size }; }
 
@@ -56,100 +945,705 @@ struct packer::impl
 
 	ptr get_bss(ptr base) const
 	{
-		constexpr int x = alignof(int64_t);
-        return { (base.offset + (x - 1)) / x * x };
+		constexpr int x = alignof(int64_t);
+        return { (base.offset + (x - 1)) / x * x };
+	}
+};
+
+packer::packer() : packer(packer_options{}) {}
+
+packer::packer(packer_options opts) : impl_(new impl(opts))
+{
+	impl_->v.reserve(1024);
+}
+
+packer::packer(packer&&) = default;
+packer& packer::operator=(packer&&) = default;
+packer::~packer() = default;
+
+void packer::start(std::function<write_sig> f)
+{
+	if (impl_->direct)
+		throw std::invalid_argument{ "direct output to a function" };
+	impl_->out.target(std::move(f));
+	cur_.offset += write_struct(header{});
+	flush();
+}
+
+void packer::start(int fd)
+{
+	if (impl_->direct)
+	{
+#if !defined(_WIN32)
+		auto off = lseek(fd, 0, SEEK_CUR);
+		if (off == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		impl_->out.target_direct(fd, off);
+		io::bypass_cache(fd);
+#else
+		throw std::invalid_argument{ "direct output unsupported" };
+#endif
+	}
+	else
+	{
+		impl_->out_fd = fd;
+#if !defined(_WIN32)
+		impl_->out_base = lseek(fd, 0, SEEK_CUR);
+#endif
+		impl_->out.target(fd);
+	}
+	cur_.offset += int64_t(write_struct(header{}));
+	flush();
+}
+
+void packer::resume(int fd)
+{
+#if !defined(_WIN32)
+	if (impl_->direct)
+		throw std::invalid_argument{ "direct output cannot append" };
+
+	auto f = vvpkg::from_seekable_descriptor(fd);
+	header h, expected;
+	if (f(reinterpret_cast<char*>(&h), sizeof(h), 0) != sizeof(h) ||
+	    memcmp(&h, &expected, sizeof(h)) != 0)
+		throw std::runtime_error{ "not a LIP archive" };
+
+	auto& x = *impl_;
+	{
+		index idx(fd);
+		for (auto&& fc : idx)
+		{
+			x.v.push_back({ { new_literal(idx.name(fc)) }, fc.info,
+			                fc.mtime, fc.size_, fc.uid, fc.gid,
+			                fc.permissions, fc.begin, fc.end });
+			if (auto d = idx.digest(fc))
+				x.keep_digest(*d);
+			x.remember(fc.info, fc.begin, fc.end);
+		}
+	}
+
+	// the old bss and index are left behind, so that the old archive
+	// stays whole until finish() writes past it
+	auto end = lseek(fd, 0, SEEK_END);
+	if (end == -1)
+		throw std::system_error{ errno, std::system_category() };
+
+	x.out_fd = fd;
+	x.out_base = 0;
+	x.out.target(fd);
+	cur_ = { end };
+#else
+	(void)fd;
+	throw std::invalid_argument{ "append unsupported" };
+#endif
+}
+
+auto packer::stats() const -> packer_stats
+{
+	auto st = impl_->stats;
+	st.bytes_written = impl_->out.bytes_written();
+	st.flushes = impl_->out.flushes();
+	return st;
+}
+
+size_t packer::write_buffer(char const* p, size_t sz)
+{
+	impl_->out.write(p, sz);
+	return sz;
+}
+
+void packer::flush()
+{
+	impl_->out.flush();
+}
+
+inline ptr packer::new_literal(string_view arcname)
+{
+	auto& x = *impl_;
+	if (x.memory_budget != 0 && x.memory_used() >= x.memory_budget)
+		x.spill();
+	auto off = x.names.add(arcname);
+	if (x.by_name_ready)
+		x.by_name.emplace(impl::name_hash(arcname),
+		                  uint32_t(x.v.size()));
+	return { off };
+}
+
+void packer::add_directory(string_view arcname, ftime mtime, __off_t  msize,
+                           __uid_t uid, __gid_t gid, __mode_t permissions)
+{
+	impl_->v.push_back({ { new_literal(arcname) },
+	                     { { int(ftype::is_directory) } },
+	                     mtime, msize, uid, gid, permissions });
+}
+
+void packer::add_symlink(string_view arcname, ftime mtime, string_view target, __off_t  msize,
+                         __uid_t uid, __gid_t gid, __mode_t permissions)
+{
+	finfo info = { { int(ftype::is_symlink), hashfn(target).digest() } };
+	auto r = put(info, target.data(), target.size());
+	impl_->v.push_back(
+	    { { new_literal(arcname) },
+	      info,
+	      mtime,
+	      msize,
+	      uid,
+	      gid,
+	      permissions,
+	      r.first,
+	      r.second });
+}
+
+void packer::add_regular_file(string_view arcname, ftime mtime, __off_t  msize,
+                              __uid_t uid, __gid_t gid, __mode_t permissions,
+                              stdex::signature<refill_sig> f, feature feat)
+{
+	auto& x = *impl_;
+	auto flag = ftype::is_regular_file | feat;
+	auto start = cur_;
+
+	// spread the blocks over the workers
+	if ((flag & finfo::compression_mask) == finfo::compression_mask &&
+	    !x.workers.empty())
+	{
+		io::lz4_block_output_pass<hashfn> pass(
+		    4 * (x.workers.size() + 1),
+		    [&](size_t n, std::function<void(size_t)> const& fn) {
+			    x.for_each(n, fn);
+		    });
+		for (error_code ec;;)
+		{
+			auto r = pass.make_available(f, ec);
+			if (ec)
+				throw std::system_error{ ec };
+			else if (r.nbytes == 0)
+				break;
+			cur_.offset += int64_t(write_buffer(r.ptr, r.nbytes));
+		}
+
+		auto info = pass.stat();
+		info.flag = flag;
+		x.v.push_back({ { new_literal(arcname) }, info, mtime, msize,
+		                uid, gid, permissions, start, cur_ });
+		x.keep_digest(pass.digest());
+		return;
+	}
+
+	if (!x.dedup || (flag & int(feature::lz4_compressed)))
+	{
+		auto r = encode(f, flag, [&](char const* p, size_t n) {
+			cur_.offset += write_buffer(p, n);
+		});
+		x.v.push_back({ { new_literal(arcname) }, r.info, mtime, msize,
+		                uid, gid, permissions, start, cur_ });
+		x.keep_digest(r.digest);
+		return;
+	}
+
+	// hash before writing unless the file turns out to be large
+	std::string staged;
+	bool spilled = false;
+	auto info = encode(f, flag, [&](char const* p, size_t n) {
+		if (!spilled && staged.size() + n <= impl::staged_size)
+		{
+			staged.append(p, n);
+			return;
+		}
+
+		if (!spilled)
+		{
+			cur_.offset += int64_t(write_buffer(staged.data(), staged.size()));
+			std::string().swap(staged);
+			spilled = true;
+		}
+		cur_.offset += int64_t(write_buffer(p, n));
+	}).info;
+
+	std::pair<ptr, ptr> r;
+	if (!spilled)
+		r = put(info, staged.data(), staged.size());
+	else if (auto hit = x.lookup(info))
+	{
+		if (x.rewind(start))
+		{
+			x.stats.bytes_deduplicated += cur_ - start;
+			cur_ = start;
+			r = { hit->begin, hit->end };
+		}
+		else
+			r = { start, cur_ };
+	}
+	else
+	{
+		x.remember(info, start, cur_);
+		r = { start, cur_ };
+	}
+
+	x.v.push_back({ { new_literal(arcname) }, info, mtime, msize, uid,
+	                gid, permissions, r.first, r.second });
+}
+
+#if !defined(_WIN32)
+// whether the file in fd was written since st was taken; writes update
+// the ctime even if the mtime is set back
+static bool changed_since(int fd, struct stat const& st)
+{
+	struct stat now;
+	if (fstat(fd, &now) == -1)
+		throw std::system_error{ errno, std::system_category() };
+	return now.st_size != st.st_size ||
+	       now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+	       now.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+	       now.st_ctim.tv_sec != st.st_ctim.tv_sec ||
+	       now.st_ctim.tv_nsec != st.st_ctim.tv_nsec;
+}
+#endif
+
+void packer::add_regular_file(string_view arcname, ftime mtime,
+                              __off_t msize, __uid_t uid, __gid_t gid,
+                              __mode_t permissions, file_source src,
+                              feature feat)
+{
+	auto flag = ftype::is_regular_file | feat;
+#if !defined(_WIN32)
+	if ((flag & int(feature::lz4_compressed)) == 0)
+	{
+		struct stat st;
+		if (fstat(src.fd, &st) == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+
+		if (int64_t(st.st_blocks) * 512 < st.st_size &&
+		    add_sparse_file(arcname, mtime, uid, gid, permissions,
+		                    src.fd, st.st_size, flag))
+			return;
+
+		// like the read path, take the file up to where it ends now
+		// rather than where it ended at fstat; false if it was written
+		// during the copy, so that the copy may not be what was hashed
+		auto copied = [&] {
+			finfo info = { { flag } };
+			auto len = int64_t(st.st_size);
+			if (src.digest)
+				info.digest = *src.digest;
+			else
+			{
+				hashfn h;
+				len = io::hash_upto(
+				    h, src.fd, 0,
+				    std::numeric_limits<int64_t>::max());
+				info.digest = h.digest();
+			}
+
+			ptr start, end;
+			if (auto hit = impl_->lookup(info))
+			{
+				impl_->stats.bytes_deduplicated +=
+				    hit->end - hit->begin;
+				start = hit->begin;
+				end = hit->end;
+			}
+			else
+			{
+				start = cur_;
+				flush();
+				auto n = io::copy_upto(src.fd, 0, impl_->out_fd,
+				                       len,
+				                       impl_->stats.bytes_copied);
+				if (n != len || changed_since(src.fd, st))
+				{
+					if (!impl_->rewind(start))
+						cur_.offset += n;
+					return false;
+				}
+				cur_.offset += n;
+				end = cur_;
+				impl_->remember(info, start, end);
+			}
+			impl_->v.push_back({ { new_literal(arcname) }, info,
+			                     mtime, msize, uid, gid,
+			                     permissions, start, end });
+			return true;
+		};
+
+		if (impl_->out_fd != -1 && copied())
+			return;
+	}
+#endif
+
+
+	add_regular_file(arcname, mtime, msize, uid, gid, permissions,
+	                 [rd = vvpkg::from_descriptor(src.fd)](
+	                     char* p, size_t sz, error_code& ec) {
+		                 auto n = rd(p, sz);
+		                 if (n == -1)
+			                 ec.assign(errno, std::system_category());
+		                 return size_t(n);
+	                 },
+	                 feat);
+}
+
+#if !defined(_WIN32)
+// stores the data extents of a file with holes, if it has any
+bool packer::add_sparse_file(string_view arcname, ftime mtime,
+                             __uid_t uid, __gid_t gid,
+                             __mode_t permissions, int fd, int64_t size,
+                             uint32_t flag)
+{
+	auto& x = *impl_;
+	auto extents = io::data_extents(fd, size);
+	int64_t stored = 0;
+	for (auto& e : extents)
+		stored += e.length;
+	if (stored == size)
+		return false;
+
+	int64_t n = int64_t(extents.size());
+	std::string map(sizeof(n) + sizeof(extent) * extents.size(), '\0');
+	memcpy(&map[0], &n, sizeof(n));
+	memcpy(&map[sizeof(n)], extents.data(), sizeof(extent) * extents.size());
+
+	// the digest is of the content with the holes read as zeros, so
+	// that it does not depend on how the file is laid out
+	hashfn h;
+	int64_t pos = 0;
+	auto zeros = [&](int64_t len) {
+		static char const buf[64 * 1024] = {};
+		for (; len > 0; len -= int64_t(sizeof(buf)))
+			h.update(buf, size_t(std::min<int64_t>(len, sizeof(buf))));
+	};
+	for (auto& e : extents)
+	{
+		zeros(e.offset - pos);
+		if (io::hash_upto(h, fd, e.offset, e.length) != e.length)
+			throw std::runtime_error{ "racy file access" };
+		pos = e.offset + e.length;
+	}
+	zeros(size - pos);
+	finfo info = { { flag | int(feature::sparse), h.digest() } };
+	auto msize = __off_t(size);
+
+	hashfn layout;
+	layout.update(map);
+	layout.update(reinterpret_cast<char const*>(info.digest.data()),
+	              info.digest.size());
+	auto key = layout.digest();
+
+	auto start = cur_;
+	auto hit = x.dedup ? x.sparse_regions.find(key) : x.sparse_regions.end();
+	if (hit != x.sparse_regions.end())
+	{
+		auto& r = hit->second;
+		x.stats.bytes_deduplicated += r.end - r.begin;
+		x.v.push_back({ { new_literal(arcname) }, info, mtime, msize,
+		                uid, gid, permissions, r.begin, r.end });
+		return true;
+	}
+
+	cur_.offset += int64_t(write_buffer(map.data(), map.size()));
+	if (x.out_fd != -1)
+		flush();
+	std::unique_ptr<char[]> buf;
+	for (auto& e : extents)
+	{
+		if (x.out_fd != -1)
+			x.stats.bytes_copied += io::copy_region(
+			    fd, e.offset, x.out_fd, e.length);
+		else
+		{
+			constexpr size_t bufsize = 64 * 1024;
+			if (!buf)
+				buf.reset(new char[bufsize]);
+			for (int64_t done = 0; done != e.length;)
+			{
+				auto n = ::pread(
+				    fd, buf.get(),
+				    size_t(std::min<int64_t>(e.length - done,
+				                             bufsize)),
+				    e.offset + done);
+				if (n == -1 && errno == EINTR)
+					continue;
+				else if (n == -1)
+					throw std::system_error{
+						errno, std::system_category()
+					};
+				else if (n == 0)
+					throw std::runtime_error{
+						"racy file access"
+					};
+				write_buffer(buf.get(), size_t(n));
+				done += n;
+			}
+		}
+		cur_.offset += e.length;
+	}
+
+	if (x.dedup)
+		x.sparse_regions.emplace(key, impl::region{ start, cur_ });
+	x.v.push_back({ { new_literal(arcname) }, info, mtime, msize, uid,
+	                gid, permissions, start, cur_ });
+	return true;
+}
+#endif
+
+void packer::add_regular_file(string_view arcname, ftime mtime,
+                              __off_t msize, __uid_t uid, __gid_t gid,
+                              __mode_t permissions, stored_source src,
+                              feature feat)
+{
+	auto& x = *impl_;
+	auto& fc = *src.entry;
+	auto flag = ftype::is_regular_file | feat;
+	if (fc.type() != ftype::is_regular_file ||
+	    (fc.info.flag & finfo::compression_mask) !=
+	        (flag & finfo::compression_mask))
+		throw std::invalid_argument{ "representation mismatch" };
+
+	auto info = fc.info;
+	info.flag = flag | (fc.info.flag & int(feature::sparse));
+	if (fc.is_sparse())
+		msize = fc.size_;
+
+	auto start = cur_;
+	if (auto hit = x.lookup(info))
+	{
+		x.stats.bytes_deduplicated += hit->end - hit->begin;
+		x.v.push_back({ { new_literal(arcname) }, info, mtime, msize,
+		                uid, gid, permissions, hit->begin, hit->end });
+		if (src.digest)
+			x.keep_digest(*src.digest);
+		return;
+	}
+
+#if !defined(_WIN32)
+	if (x.out_fd != -1 && src.fd != -1)
+	{
+		flush();
+		x.stats.bytes_copied += io::copy_region(
+		    src.fd, fc.begin.offset, x.out_fd, fc.stored_size());
+		cur_.offset += fc.stored_size();
+	}
+	else
+#endif
+	{
+		io::raw_regional_input_pass pass(fc.begin.offset,
+		                                 fc.end.offset);
+		for (error_code ec;;)
+		{
+			auto r = pass.make_available(src.f, ec);
+			if (ec)
+				throw std::system_error{ ec };
+			else if (r.nbytes == 0)
+				break;
+			cur_.offset += int64_t(write_buffer(r.ptr, r.nbytes));
+		}
 	}
-};
 
-packer::packer() : impl_(new impl)
-{
-	impl_->v.reserve(1024);
+	x.remember(info, start, cur_);
+	x.v.push_back({ { new_literal(arcname) }, info, mtime, msize, uid,
+	                gid, permissions, start, cur_ });
+	if (src.digest)
+		x.keep_digest(*src.digest);
 }
 
-packer::packer(packer&&) = default;
-packer& packer::operator=(packer&&) = default;
-packer::~packer() = default;
-
-constexpr auto operator|(ftype a, feature b)
+void packer::post_regular_file(string_view arcname, ftime mtime,
+                               __off_t msize, __uid_t uid, __gid_t gid,
+                               __mode_t permissions,
+                               std::function<refill_sig> f, feature feat)
 {
-	return uint32_t(a) | uint32_t(b);
-}
+	auto& x = *impl_;
+	if (x.workers.empty() || msize > impl::staged_size)
+		return add_regular_file(arcname, mtime, msize, uid, gid,
+		                        permissions, f, feat);
 
-void packer::start(std::function<write_sig> f)
-{
-	write_ = std::move(f);
-	cur_.offset += write_struct(header{});
+	drain(2 * x.workers.size() - 1);
+	x.submit(std::unique_ptr<impl::job>(new impl::job{
+	    std::string(arcname), mtime, msize, uid, gid, permissions,
+	    std::move(f), ftype::is_regular_file | feat }));
 }
 
-inline ptr packer::new_literal(string_view arcname)
+void packer::add_hardlink(string_view arcname, string_view existing,
+                          ftime mtime, __off_t msize, __uid_t uid,
+                          __gid_t gid, __mode_t permissions)
 {
-	impl_->m.update(arcname.data(), arcname.size()) = int(impl_->v.size());
-	return {};
-}
+	auto& x = *impl_;
+	io::spilled_entry e;
 
-void packer::add_directory(string_view arcname, ftime mtime, __off_t  msize,
-                           __uid_t uid, __gid_t gid, __mode_t permissions)
-{
-	impl_->v.push_back({ { new_literal(arcname) },
-	                     { { int(ftype::is_directory) } },
-	                     mtime, msize, uid, gid, permissions });
+	// the entry may still be in the pipeline
+	auto found = x.find_entry(existing, e);
+	if (!found)
+	{
+		drain(0);
+		found = x.find_entry(existing, e);
+	}
+	if (!found || e.fc.type() != ftype::is_regular_file)
+		throw std::invalid_argument{ "no regular file to link to" };
+
+	auto& fc = e.fc;
+	if (fc.is_sparse())
+		msize = fc.size_;
+	x.v.push_back({ { new_literal(arcname) }, fc.info, mtime, msize, uid,
+	                gid, permissions, fc.begin, fc.end });
+	if (e.has_digest)
+		x.keep_digest(e.digest);
 }
 
-void packer::add_symlink(string_view arcname, ftime mtime, string_view target, __off_t  msize,
-                         __uid_t uid, __gid_t gid, __mode_t permissions)
+void packer::set_status(string_view arcname, uint64_t device,
+                        uint64_t inode, ftime ctime)
 {
-	auto start = cur_;
-	cur_.offset += write_buffer(target.data(), target.size());
-	impl_->v.push_back(
-	    { { new_literal(arcname) },
-	      { { int(ftype::is_symlink), hashfn(target).digest() } },
-	      mtime,
-	      msize,
-	      uid,
-	      gid,
-	      permissions,
-	      start,
-	      cur_ });
+	impl_->statuses[std::string(arcname.data(), arcname.size())] = {
+		0, 0, device, inode, ctime
+	};
 }
 
-void packer::add_regular_file(string_view arcname, ftime mtime, __off_t  msize,
-                              __uid_t uid, __gid_t gid, __mode_t permissions,
-                              stdex::signature<refill_sig> f, feature feat)
+void packer::add_archive(stored_archive src)
 {
-	using raw = io::raw_output_pass<hashfn>;
-	using lz4 = io::lz4_output_pass;
+	auto& x = *impl_;
+	auto& idx = *src.entries;
 
-	auto start = cur_;
-	auto flag = ftype::is_regular_file | feat;
-	auto rep = flag & finfo::rep_mask;
-	auto pass = [=]() -> stdex::oneof<raw, lz4> {
-		if (rep == int(feature::lz4_compressed))
-			return lz4{};
+	// entries with data in the order of their data
+	std::vector<fcard const*> by_data;
+	for (auto&& fc : idx)
+		if (fc.stored_size() != 0)
+			by_data.push_back(&fc);
+	std::sort(by_data.begin(), by_data.end(),
+	          [](fcard const* a, fcard const* b) {
+		          return a->begin.offset < b->begin.offset ||
+		                 (a->begin.offset == b->begin.offset &&
+		                  a->end.offset < b->end.offset);
+	          });
+
+	// the data of [run_begin, run_end) go to cur_ in one piece
+	int64_t run_begin = 0, run_end = 0;
+	auto copy_run = [&] {
+		auto len = run_end - run_begin;
+		if (len == 0)
+			return;
+#if !defined(_WIN32)
+		if (x.out_fd != -1 && src.fd != -1)
+		{
+			flush();
+			x.stats.bytes_copied +=
+			    io::copy_region(src.fd, run_begin, x.out_fd, len);
+			cur_.offset += len;
+		}
 		else
-			return raw{};
-	}();
+#endif
+		{
+			io::raw_regional_input_pass pass(run_begin, run_end);
+			for (error_code ec;;)
+			{
+				auto r = pass.make_available(src.f, ec);
+				if (ec)
+					throw std::system_error{ ec };
+				else if (r.nbytes == 0)
+					break;
+				cur_.offset += int64_t(write_buffer(r.ptr, r.nbytes));
+			}
+		}
+		run_begin = run_end;
+	};
 
-	for (error_code ec;;)
+	// where the data of each entry end up, by position in idx
+	std::vector<std::pair<ptr, ptr>> placed(size_t(idx.size()));
+	for (size_t i = 0; i != by_data.size();)
 	{
-		auto r = pass.match(
-		    [&](auto& x) { return x.make_available(f, ec); });
-		if (ec)
-			throw std::system_error{ ec };
-		else if (r.nbytes == 0)
-			break;
+		auto& fc = *by_data[i];
+		auto j = i + 1;
+		while (j != by_data.size() &&
+		       by_data[j]->begin.offset == fc.begin.offset &&
+		       by_data[j]->end.offset == fc.end.offset)
+			++j;
+
+		std::pair<ptr, ptr> to;
+		// a sparse entry and a plain one of the same content are
+		// stored differently
+		auto hit = fc.is_sparse() ? nullptr : x.lookup(fc.info);
+		if (hit)
+		{
+			x.stats.bytes_deduplicated += hit->end - hit->begin;
+			to = { hit->begin, hit->end };
+		}
+		else
+		{
+			if (fc.begin.offset < run_end)
+				throw std::runtime_error{ "overlapping entries" };
+			if (fc.begin.offset != run_end)
+			{
+				copy_run();
+				run_begin = run_end = fc.begin.offset;
+			}
+			to.first = { cur_.offset + run_end - run_begin };
+			to.second = { to.first.offset + fc.stored_size() };
+			run_end = fc.end.offset;
+			if (!fc.is_sparse())
+				x.remember(fc.info, to.first, to.second);
+		}
 
-		cur_.offset += write_buffer(r.ptr, r.nbytes);
+		for (; i != j; ++i)
+			placed[size_t(by_data[i] - idx.begin())] = to;
 	}
+	copy_run();
 
-	auto info = pass.match([](auto& x) { return x.stat(); });
-	info.flag = flag;
-	impl_->v.push_back(
-	    { { new_literal(arcname) }, info, mtime,
-          msize,
-          uid,
-          gid,
-          permissions,
-          start, cur_ });
+	x.v.reserve(x.v.size() + placed.size());
+	for (auto&& fc : idx)
+	{
+		auto to = placed[size_t(&fc - idx.begin())];
+		if (fc.stored_size() == 0 && fc.type() != ftype::is_directory)
+			to = { cur_, cur_ };
+		x.v.push_back({ { new_literal(idx.name(fc)) }, fc.info, fc.mtime,
+		                fc.size_, fc.uid, fc.gid, fc.permissions,
+		                to.first, to.second });
+		if (auto d = idx.digest(fc))
+			x.keep_digest(*d);
+	}
+}
+
+// commits the finished payloads, waiting for more until no more than
+// `limit` files are in flight
+void packer::drain(size_t limit)
+{
+	auto& x = *impl_;
+	for (;;)
+	{
+		std::unique_ptr<impl::job> j;
+		{
+			std::unique_lock<std::mutex> lk(x.mu);
+			if (x.done.empty() && x.inflight <= limit)
+				return;
+			x.done_cv.wait(lk, [&] { return !x.done.empty(); });
+			j = std::move(x.done.front());
+			x.done.pop_front();
+			--x.inflight;
+		}
+
+		if (j->error)
+			std::rethrow_exception(j->error);
+
+		auto r = put(j->info, j->data.data(), j->data.size());
+		x.v.push_back({ { new_literal(j->arcname) }, j->info, j->mtime,
+		                j->msize, j->uid, j->gid, j->permissions,
+		                r.first, r.second });
+		x.keep_digest(j->digest);
+	}
+}
+
+// writes an encoded payload, or finds the same bytes already written
+auto packer::put(finfo const& info, char const* p, size_t sz)
+    -> std::pair<ptr, ptr>
+{
+	auto& x = *impl_;
+	if (auto hit = x.lookup(info))
+	{
+		x.stats.bytes_deduplicated += hit->end - hit->begin;
+		return { hit->begin, hit->end };
+	}
+
+	auto start = cur_;
+	cur_.offset += write_buffer(p, sz);
+	x.remember(info, start, cur_);
+	return { start, cur_ };
 }
 
 void packer::write_bss()
@@ -157,17 +1651,14 @@ void packer::write_bss()
     // align for the start of bss
     auto diff_ = size_t(impl_->get_bss(cur_).offset - cur_.offset);
     cur_.offset += write_buffer("\0\0\0\0\0\0\0", diff_);
-    std::vector<char> s;
-    cedar::npos_t from = 0;
-    size_t sz = 0;
-    auto& m = impl_->m;
-    for (int i = m.begin(from, sz); i != impl::npos; i = m.next(from, sz))
-	{
-		s.resize(sz + 1);
-		m.suffix(s.data(), sz, from);
-		impl_->v[size_t(i)].name = impl_->get_bes(cur_);
-		impl_->bss_size += write_buffer(s.data(), s.size());
-	}
+	impl_->seal();
+	impl_->bss_size += impl_->write_extension();
+	impl_->names_begin = impl_->get_bes(cur_);
+	impl_->entries([&](fcard const&, string_view name, fhash const*) {
+		write_buffer(name.data(), name.size());
+		write_buffer("", 1);
+		impl_->bss_size += int64_t(name.size() + 1);
+	});
     // align here for the end of bss
 	auto diff = size_t(impl_->get_index(cur_).offset -
 	                   impl_->get_bes(cur_).offset);
@@ -175,15 +1666,24 @@ void packer::write_bss()
 
 }
 
+// a copy of fc with the padding before `begin` cleared
+static fcard without_padding(fcard fc)
+{
+	auto end_of_permissions =
+	    offsetof(fcard, permissions) + sizeof(fc.permissions);
+	memset(reinterpret_cast<char*>(&fc) + end_of_permissions, 0,
+	       offsetof(fcard, begin) - end_of_permissions);
+	return fc;
+}
+
 void packer::write_index()
 {
-	cedar::npos_t from = 0;
-	size_t sz = 0;
-	auto& m = impl_->m;
-	for (int i = m.begin(from, sz); i != impl::npos; i = m.next(from, sz))
-	{
-		write_struct(impl_->v[size_t(i)]);
-	}
+	auto name = impl_->names_begin;
+	impl_->entries([&](fcard fc, string_view arcname, fhash const*) {
+		fc.name = name;
+		name.offset += int64_t(arcname.size() + 1);
+		write_struct(without_padding(fc));
+	});
 }
 
 void packer::write_section_pointers()
@@ -192,6 +1692,18 @@ void packer::write_section_pointers()
 	write_struct(impl_->get_bss(cur_));
 }
 
+packer_stats merge(int fd, std::vector<stored_archive> const& inputs,
+                   packer_options opts)
+{
+	opts.dedup = true;
+	packer pk(opts);
+	pk.start(fd);
+	for (auto&& src : inputs)
+		pk.add_archive(src);
+	pk.finish();
+	return pk.stats();
+}
+
 index::index(stdex::signature<pread_sig> f, int64_t filesize, ptr* pointers)
 {
 	auto pread_exact = [=](char* p, size_t sz, int64_t from) mutable {
@@ -210,26 +1722,457 @@ index::index(stdex::signature<pread_sig> f, int64_t filesize, ptr* pointers)
 	auto blen = size_t(filesize - eof[1].offset);
 	bp_.reset(new char[blen]);  // contains everything after data in LIP, starts from BSS
 	pread_exact(bp_.get(), blen, eof[1].offset);
-	pointers[0] = eof[0];
-	pointers[1] = eof[1];
+	if (pointers)
+	{
+		pointers[0] = eof[0];
+		pointers[1] = eof[1];
+	}
 
 	eof[0].adjust(bp_.get(), eof[1]);
-	first_ = eof[0].pointer_to<fcard>();    // points to the start of index(first index)
+	auto first = eof[0].pointer_to<fcard>();    // points to the start of index(first index)
 	endidx.adjust(bp_.get(), eof[1]);
-	last_ = endidx.pointer_to<fcard>();
+	auto last = endidx.pointer_to<fcard>();
 
-	std::for_each(first_, last_,
+	std::for_each(first, last,
 	              [&](fcard& fc) { fc.name.adjust(bp_.get(), eof[1]); });
+	first_ = first;
+	last_ = last;
+
+	find_extension(bp_.get(), eof[0] - eof[1]);
 }
 
-void content::copy(fcard const& fc, stdex::signature<write_sig> g) &&
+index::index(int fd, ptr* pointers)
+{
+	auto filesize = int64_t(vvpkg::xfstat(fd).st_size);
+#if !defined(_WIN32)
+	ptr eof[2];
+	auto endidx = filesize - int64_t(sizeof(eof));
+	if (endidx < int64_t(sizeof(header)) ||
+	    ::pread(fd, eof, sizeof(eof), endidx) != ssize_t(sizeof(eof)))
+		throw std::runtime_error{ "not a LIP archive" };
+	if (eof[1].offset < int64_t(sizeof(header)) || eof[0] - eof[1] < 0 ||
+	    eof[0].offset > endidx ||
+	    (endidx - eof[0].offset) % int64_t(sizeof(fcard)) != 0)
+		throw std::runtime_error{ "malformed index" };
+	if (pointers)
+	{
+		pointers[0] = eof[0];
+		pointers[1] = eof[1];
+	}
+
+	auto from = eof[1].offset / sysconf(_SC_PAGESIZE) *
+	            sysconf(_SC_PAGESIZE);
+	auto len = size_t(filesize - from);
+	auto p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, from);
+	if (p == MAP_FAILED)
+		throw std::system_error{ errno, std::system_category() };
+	map_ = { static_cast<char*>(p), unmapper{ len } };
+
+	names_ = reinterpret_cast<intptr_t>(p) - from;
+	first_ = reinterpret_cast<fcard const*>(names_ + eof[0].offset);
+	last_ = reinterpret_cast<fcard const*>(names_ + endidx);
+	find_extension(map_.get() + (eof[1].offset - from), eof[0] - eof[1]);
+#else
+	*this = index(vvpkg::from_seekable_descriptor(fd), filesize, pointers);
+#endif
+}
+
+void index::unmapper::operator()(char* p) const noexcept
+{
+#if !defined(_WIN32)
+	munmap(p, len);
+#else
+	(void)p;
+#endif
+}
+
+// bss of the given size begins with the extension if any
+void index::find_extension(char const* bss, int64_t size)
+{
+	auto ext = reinterpret_cast<extension_header const*>(bss);
+	if (size >= int64_t(sizeof(extension_header)) &&
+	    memcmp(ext->magic, extension_header{}.magic, sizeof(ext->magic)) ==
+	        0)
+	{
+		if (ext->size < int64_t(sizeof(*ext)) || ext->size > size ||
+		    ext->count < 0 ||
+		    size_t(ext->count) > (size_t(ext->size) - sizeof(*ext)) /
+		                             sizeof(lip::section))
+			throw std::runtime_error{ "malformed extension" };
+		ext_ = ext;
+
+		auto c = section(section_tag::child_table);
+		if (!c.empty())
+		{
+			if (c.size() % sizeof(uint32_t) != 0 ||
+			    c.size() / sizeof(uint32_t) <
+			        size_t(last_ - first_) + 2)
+				throw std::runtime_error{
+					"malformed child table"
+				};
+			children_ = reinterpret_cast<uint32_t const*>(c.data());
+			children_size_ = c.size() / sizeof(uint32_t);
+		}
+
+		auto d = section(section_tag::digest_order);
+		if (d.size() % sizeof(uint32_t) != 0)
+			throw std::runtime_error{ "malformed digest order" };
+		by_digest_ = reinterpret_cast<uint32_t const*>(d.data());
+		by_digest_size_ = d.size() / sizeof(uint32_t);
+
+		auto bf = section(section_tag::name_filter);
+		if (bf.size() % sizeof(filter_block) != 0)
+			throw std::runtime_error{ "malformed name filter" };
+		if (!bf.empty())
+		{
+			filter_ = reinterpret_cast<filter_block const*>(bf.data());
+			filter_blocks_ = bf.size() / sizeof(filter_block);
+		}
+
+		auto t = section(section_tag::search_tree);
+		if (!t.empty())
+		{
+			if (t.size() !=
+			    (size_t(last_ - first_) + 1) * sizeof(search_node))
+				throw std::runtime_error{
+					"malformed search tree"
+				};
+			tree_ = reinterpret_cast<search_node const*>(t.data());
+		}
+
+		auto s = section(section_tag::name_table);
+		auto cap = s.size() / sizeof(name_slot);
+		if (s.empty())
+			return;
+		if (s.size() % sizeof(name_slot) != 0 || (cap & (cap - 1)) != 0 ||
+		    cap / 2 < size_t(last_ - first_))
+			throw std::runtime_error{ "malformed name table" };
+		slots_ = reinterpret_cast<name_slot const*>(s.data());
+		slot_mask_ = cap - 1;
+	}
+}
+
+bool index::in_filter(uint64_t h) const
+{
+	filter_block mask = {};
+	filter_bits(h, mask);
+	auto& block = filter_[filter_block_of(h, filter_blocks_)];
+	for (int i = 0; i < 8; ++i)
+		if ((block.words[i] & mask.words[i]) != mask.words[i])
+			return false;
+	return true;
+}
+
+auto index::find_hashed(string_view arcname) const -> iterator
+{
+	auto h = arcname_hash(arcname);
+	if (filter_ && !in_filter(h))
+		return end();
+	if (!slots_)
+		return search(arcname);
+
+	for (auto j = h & slot_mask_;; j = (j + 1) & slot_mask_)
+	{
+		auto& slot = slots_[j];
+		if (slot.entry == 0)
+			return end();
+		if (slot.hash == uint32_t(h >> 32))
+		{
+			if (slot.entry > uint32_t(size()))
+				throw std::runtime_error{
+					"malformed name table"
+				};
+			auto it = begin() + (slot.entry - 1);
+			if (name(*it) == arcname)
+				return it;
+		}
+	}
+}
+
+// the number of leading zero bytes in x, which is not 0
+static size_t leading_zero_bytes(uint64_t x)
+{
+#if defined(__GNUC__)
+	return size_t(__builtin_clzll(x)) / 8;
+#else
+	size_t i = 0;
+	for (; (x >> 56) == 0; x <<= 8)
+		++i;
+	return i;
+#endif
+}
+
+auto index::find_in_tree(string_view arcname) const -> iterator
+{
+	auto n = size_t(size());
+	size_t k = 1;
+	// the length of the prefix arcname shares with the parent of node
+	// k, and whether node k is a right child
+	size_t d = 0;
+	bool right = false;
+	while (k <= n)
+	{
+		auto& node = tree_[k];
+#if defined(__GNUC__)
+		// the grandchildren of a node share a cache line
+		__builtin_prefetch(tree_ + 4 * k);
+#endif
+		bool less;
+		uint64_t key;
+		if (d != node.offset)
+		{
+			// the node and arcname lie on the same side of the
+			// parent; the one departing later from it is closer
+			less = (d > node.offset) != right;
+			d = std::min(d, size_t(node.offset));
+		}
+		else if ((key = search_key(arcname, d)) != node.key)
+		{
+			less = node.key < key;
+			d += leading_zero_bytes(node.key ^ key);
+		}
+		else
+		{
+			// only a tie on the key reads the arcname of the node
+			if (node.entry >= n)
+				throw std::runtime_error{
+					"malformed search tree"
+				};
+			string_view s = name(begin()[node.entry]);
+			while (d < s.size() && d < arcname.size() &&
+			       s[d] == arcname[d])
+				++d;
+			less = d < arcname.size() &&
+			       (d >= s.size() ||
+			        static_cast<unsigned char>(s[d]) <
+			            static_cast<unsigned char>(arcname[d]));
+		}
+		k = 2 * k + size_t(less);
+		right = less;
+	}
+
+	// undo the right turns after the last left turn, which was taken
+	// at the lower bound
+	while (k & 1)
+		k >>= 1;
+	k >>= 1;
+	if (k == 0 || tree_[k].entry >= n)
+		return end();
+	auto it = begin() + tree_[k].entry;
+	if (name(*it) == arcname)
+		return it;
+	else
+		return end();
+}
+
+auto index::subtree(string_view dir) const -> std::pair<iterator, iterator>
+{
+	if (dir.empty())
+		return { begin(), end() };
+
+	auto bound = [&](string_view x) {
+		return std::lower_bound(begin(), end(), x,
+		                        [&](fcard const& fc, string_view target) {
+			                        return name(fc) < target;
+		                        });
+	};
+	std::string prefix(dir.data(), dir.size());
+	prefix += '/';
+	auto first = bound(prefix);
+	prefix.back() = '/' + 1;
+	return { first, bound(prefix) };
+}
+
+auto index::children(string_view dir) const -> subset
+{
+	subset r;
+	r.base_ = first_;
+
+	// the child table lists entries under directories only
+	auto it = dir.empty() ? begin() : find(dir);
+	if (children_ && (dir.empty() ||
+	                  (it != end() && it->type() == ftype::is_directory)))
+	{
+		auto n = size_t(size());
+		auto node = dir.empty() ? 0 : size_t(it - begin()) + 1;
+		auto a = children_[node], b = children_[node + 1];
+		if (a > b || b > children_size_ - n - 2)
+			throw std::runtime_error{ "malformed child table" };
+		r.first_ = children_ + n + 2 + a;
+		r.last_ = children_ + n + 2 + b;
+		if (std::any_of(r.first_, r.last_,
+		                [=](uint32_t i) { return i >= n; }))
+			throw std::runtime_error{ "malformed child table" };
+		return r;
+	}
+
+	auto range = subtree(dir);
+	auto skip = dir.empty() ? 0 : dir.size() + 1;
+	for (auto x = range.first; x != range.second; ++x)
+		if (strchr(name(*x) + skip, '/') == nullptr)
+			r.found_.push_back(uint32_t(x - begin()));
+	r.first_ = r.found_.data();
+	r.last_ = r.first_ + r.found_.size();
+	return r;
+}
+
+// the leading bytes of a digest as a number
+static uint64_t digest_prefix(fhash const& d)
+{
+	uint64_t x = 0;
+	for (int i = 0; i < 8; ++i)
+		x = x << 8 | d[size_t(i)];
+	return x;
+}
+
+auto index::find_by_digest(fhash const& d) const -> subset
+{
+	subset r;
+	r.base_ = first_;
+
+	if (by_digest_size_ == 0)
+	{
+		for (auto it = begin(); it != end(); ++it)
+		{
+			auto p = digest(*it);
+			if (p && *p == d)
+				r.found_.push_back(uint32_t(it - begin()));
+		}
+		r.first_ = r.found_.data();
+		r.last_ = r.first_ + r.found_.size();
+		return r;
+	}
+
+	auto key = [&](size_t i) -> fhash const& {
+		auto pos = by_digest_[i];
+		fhash const* p;
+		if (pos >= uint32_t(size()) || (p = digest(first_[pos])) == nullptr)
+			throw std::runtime_error{ "malformed digest order" };
+		return *p;
+	};
+
+	// the digests are uniformly distributed, so interpolate on their
+	// leading bytes, halving the range when that fails to
+	size_t lo = 0, hi = by_digest_size_;
+	double klo = 0, khi = 18446744073709551616.0;
+	auto x = double(digest_prefix(d));
+	for (bool bisect = false; lo != hi;)
+	{
+		auto before = hi - lo;
+		auto mid = lo + (hi - lo) / 2;
+		if (!bisect && khi > klo)
+			mid = lo + std::min(size_t((x - klo) / (khi - klo) *
+			                           double(hi - lo)),
+			                    hi - lo - 1);
+		auto& k = key(mid);
+		if (k < d)
+		{
+			lo = mid + 1;
+			klo = double(digest_prefix(k));
+		}
+		else
+		{
+			hi = mid;
+			khi = double(digest_prefix(k));
+		}
+		bisect = !bisect && hi - lo > before / 2;
+	}
+	hi = lo;
+	while (hi != by_digest_size_ && key(hi) == d)
+		++hi;
+	r.first_ = by_digest_ + lo;
+	r.last_ = by_digest_ + hi;
+	return r;
+}
+
+auto index::find_by_name(string_view arcname) const -> iterator
+{
+	auto key = [&](uint32_t i) { return removeDirName(name(first_[i])); };
+	auto& v = by_root_name_->positions;
+	std::call_once(by_root_name_->sorted, [&] {
+		v.resize(size_t(size()));
+		std::iota(v.begin(), v.end(), 0u);
+		std::stable_sort(v.begin(), v.end(), [&](uint32_t a, uint32_t b) {
+			return key(a) < key(b);
+		});
+	});
+
+	auto target = removeDirName(arcname);
+	auto it = std::lower_bound(
+	    v.begin(), v.end(), target,
+	    [&](uint32_t i, string_view x) { return key(i) < x; });
+	if (it != v.end() && key(*it) == target)
+		return begin() + *it;
+	else
+		return end();
+}
+
+auto index::section(section_tag tag) const -> string_view
+{
+	if (ext_ == nullptr)
+		return {};
+
+	auto base = reinterpret_cast<char const*>(ext_);
+	auto table = reinterpret_cast<lip::section const*>(ext_ + 1);
+	for (auto it = table; it != table + ext_->count; ++it)
+	{
+		if (it->tag != tag)
+			continue;
+		if (it->offset < 0 || it->size < 0 ||
+		    it->offset > ext_->size || it->size > ext_->size - it->offset)
+			throw std::runtime_error{ "malformed extension" };
+		return { base + it->offset, size_t(it->size) };
+	}
+	return {};
+}
+
+fhash const* index::digest(fcard const& fc) const
+{
+	if (fc.type() == ftype::is_directory)
+		return nullptr;
+	if (!fc.is_lz4_compressed())
+		return &fc.info.digest;
+
+	auto s = section(section_tag::lz4_digests);
+	auto first = reinterpret_cast<lz4_digest const*>(s.data());
+	auto last = first + s.size() / sizeof(lz4_digest);
+	auto entry = uint32_t(&fc - first_);
+	auto it = std::lower_bound(
+	    first, last, entry,
+	    [](lz4_digest const& d, uint32_t n) { return d.entry < n; });
+	if (it == last || it->entry != entry)
+		return nullptr;
+	return &it->digest;
+}
+
+file_status const* index::status(fcard const& fc) const
+{
+	auto s = section(section_tag::file_status);
+	auto first = reinterpret_cast<file_status const*>(s.data());
+	auto last = first + s.size() / sizeof(file_status);
+	auto entry = uint32_t(&fc - first_);
+	auto it = std::lower_bound(
+	    first, last, entry,
+	    [](file_status const& st, uint32_t n) { return st.entry < n; });
+	if (it == last || it->entry != entry)
+		return nullptr;
+	return it;
+}
+
+static void pread_exact(stdex::signature<pread_sig> f, void* p, size_t sz,
+                        int64_t from)
 {
-	using raw = io::raw_regional_input_pass;
-	auto pass = raw(fc.begin.offset, fc.end.offset);
+	if (f(static_cast<char*>(p), sz, from) != sz)
+		throw std::system_error{ errno, std::system_category() };
+}
 
+// writes what pass makes available from f into g
+template <class Pass, class G>
+static void pump(Pass& pass, stdex::signature<pread_sig> f, G&& g)
+{
 	for (error_code ec;;)
 	{
-		auto r = pass.make_available(f_, ec);
+		auto r = pass.make_available(f, ec);
 		if (!ec)
 		{
 			if (r.nbytes == 0)
@@ -243,4 +2186,165 @@ void content::copy(fcard const& fc, stdex::signature<write_sig> g) &&
 	}
 }
 
+// writes the bytes from begin to end read by f into g
+template <class G>
+static void copy_stored(stdex::signature<pread_sig> f, int64_t begin,
+                        int64_t end, G&& g)
+{
+	io::raw_regional_input_pass pass(begin, end);
+	pump(pass, f, g);
+}
+
+// the number of blocks in an entry with lz4_blocks, and where the table
+// of their offsets begins
+static std::pair<int64_t, int64_t> block_table(
+    stdex::signature<pread_sig> f, fcard const& fc)
+{
+	int64_t n;
+	pread_exact(f, &n, sizeof(n), fc.end.offset - int64_t(sizeof(n)));
+	if (n < 0 || n >= fc.stored_size() / int64_t(sizeof(n)))
+		throw std::runtime_error{ "bad block table" };
+	return { n, fc.end.offset - int64_t(sizeof(n)) * (n + 1) };
+}
+
+// decodes the LZ4 frames from begin to end into g
+template <class G>
+static void copy_lz4(stdex::signature<pread_sig> f, int64_t begin,
+                     int64_t end, G&& g)
+{
+	std::unique_ptr<io::lz4_input_pass> pass(
+	    new io::lz4_input_pass(begin, end));
+	pump(*pass, f, g);
+}
+
+// writes the data of a sparse entry into g, calling hole(n) for each
+// gap of n bytes
+template <class G, class H>
+static void copy_sparse(stdex::signature<pread_sig> f, fcard const& fc,
+                        G&& g, H&& hole)
+{
+	int64_t n;
+	pread_exact(f, &n, sizeof(n), fc.begin.offset);
+	if (n < 0 || n > (fc.stored_size() - int64_t(sizeof(n))) /
+	                     int64_t(sizeof(extent)))
+		throw std::runtime_error{ "bad extent map" };
+
+	std::vector<extent> extents(static_cast<size_t>(n));
+	pread_exact(f, extents.data(), sizeof(extent) * extents.size(),
+	            fc.begin.offset + int64_t(sizeof(n)));
+
+	auto from = fc.begin.offset + int64_t(sizeof(n)) +
+	            int64_t(sizeof(extent) * extents.size());
+	int64_t pos = 0;
+	for (auto& e : extents)
+	{
+		if (e.offset < pos || e.length < 0 ||
+		    e.length > fc.end.offset - from)
+			throw std::runtime_error{ "bad extent map" };
+		if (e.offset != pos)
+			hole(e.offset - pos);
+		copy_stored(f, from, from + e.length, g);
+		from += e.length;
+		pos = e.offset + e.length;
+	}
+
+	if (pos > fc.size())
+		throw std::runtime_error{ "bad extent map" };
+	else if (pos != fc.size())
+		hole(fc.size() - pos);
+}
+
+void content::copy(fcard const& fc, stdex::signature<write_sig> g) &&
+{
+	if (fc.has_lz4_blocks() && fc.is_lz4_compressed())
+		return copy_lz4(f_, fc.begin.offset, block_table(f_, fc).second,
+		                g);
+	else if (fc.is_lz4_compressed())
+		return copy_lz4(f_, fc.begin.offset, fc.end.offset, g);
+	else if (!fc.is_sparse())
+		return copy_stored(f_, fc.begin.offset, fc.end.offset, g);
+
+	static char const zeros[65536] = {};
+	copy_sparse(f_, fc, g, [&](int64_t n) {
+		for (; n != 0;)
+		{
+			auto sz = size_t(std::min<int64_t>(n, sizeof(zeros)));
+			if (g(zeros, sz) != sz)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+			n -= int64_t(sz);
+		}
+	});
+}
+
+void content::copy(fcard const& fc, int64_t from,
+                   stdex::signature<write_sig> g) &&
+{
+	if (from <= 0)
+		return std::move(*this).copy(fc, g);
+	else if (!fc.is_lz4_compressed() && !fc.is_sparse())
+		return copy_stored(
+		    f_, fc.begin.offset + std::min(from, fc.stored_size()),
+		    fc.end.offset, g);
+
+	// drops the bytes before `from` in what is decoded
+	auto skip = from;
+	auto h = [&](char const* p, size_t sz) {
+		auto n = size_t(std::min(skip, int64_t(sz)));
+		skip -= int64_t(n);
+		if (n == sz || g(p + n, sz - n) == sz - n)
+			return sz;
+		else
+			return size_t(0);
+	};
+
+	if (fc.has_lz4_blocks() && fc.is_lz4_compressed())
+	{
+		using blocks = io::lz4_block_output_pass<hashfn>;
+		auto t = block_table(f_, fc);
+		auto i = from / int64_t(blocks::block_size);
+		if (i >= t.first)
+			return;
+
+		int64_t off;
+		pread_exact(f_, &off, sizeof(off),
+		            t.second + int64_t(sizeof(off)) * i);
+		skip -= i * int64_t(blocks::block_size);
+		copy_lz4(f_, fc.begin.offset + off, t.second, h);
+	}
+	else
+		std::move(*this).copy(fc, h);
+}
+
+void content::extract(fcard const& fc, int fd) &&
+{
+	auto g = [=](char const* p, size_t sz) {
+		return io::write_fully(fd, p, sz);
+	};
+
+#if !defined(_WIN32)
+	// holes are left by seeking past them and truncating at the end
+	off_t base;
+	if (fc.is_sparse() && (base = lseek(fd, 0, SEEK_CUR)) != -1 &&
+	    ftruncate(fd, base) == 0)
+	{
+		copy_sparse(f_, fc, g, [=](int64_t n) {
+			if (lseek(fd, off_t(n), SEEK_CUR) == -1)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+		});
+
+		if (ftruncate(fd, base + fc.size()) == -1 ||
+		    lseek(fd, base + fc.size(), SEEK_SET) == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		return;
+	}
+#endif
+
+	std::move(*this).copy(fc, g);
+}
+
 }
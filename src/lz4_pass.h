@@ -31,12 +31,17 @@
 #include <lip/lip.h>
 #include <lz4.h>
 #include <assert.h>
+#include <string.h>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace lip
 {
 namespace io
 {
 
+template <class Hasher>
 class lz4_output_pass
 {
 public:
@@ -48,6 +53,7 @@ public:
 		if (auto n = std::forward<F>(f)(buf_[i_], reqsize, ec))
 		{
 			total_ += n;
+			h_.update(buf_[i_], n);
 			auto block_size = LZ4_compress_fast_continue(
 			    handle_, buf_[i_], obuf_ + sizeof(int), int(n),
 			    int(sizeof(obuf_) - sizeof(int)), 1);
@@ -62,13 +68,14 @@ public:
 
 	finfo stat() const
 	{
-		finfo info;
-		info.flag_ = 0;
-		info.reserved = 0;
+		finfo info = {};
 		info.sizeopt = total_;
 		return info;
 	}
 
+	// of the original content
+	fhash digest() const { return h_.digest(); }
+
 private:
 	static constexpr size_t reqsize = 65536;
 
@@ -77,6 +84,197 @@ private:
 	alignas(int) char obuf_[sizeof(int) + LZ4_COMPRESSBOUND(reqsize)];
 	size_t i_ = 0;
 	int64_t total_ = 0;
+	Hasher h_;
+};
+
+// Decodes the frames written by lz4_output_pass, or the blocks written by
+// lz4_block_output_pass, between where and end.
+class lz4_input_pass
+{
+public:
+	lz4_input_pass(int64_t where, int64_t end) noexcept
+	    : where_(where), end_(end)
+	{
+		LZ4_setStreamDecode(handle_, nullptr, 0);
+	}
+
+	template <class F>
+	avail make_available(F&& f, error_code& ec)
+	{
+		if (where_ == end_)
+			return { buf_[i_], 0 };
+
+		int sz;
+		if (!read(f, reinterpret_cast<char*>(&sz), sizeof(sz), ec))
+			return { buf_[i_], 0 };
+		if (sz <= 0 || sz > int(sizeof(ibuf_)) ||
+		    end_ - where_ < sz)
+			return corrupt(ec);
+		if (!read(f, ibuf_, size_t(sz), ec))
+			return { buf_[i_], 0 };
+
+		auto n = LZ4_decompress_safe_continue(handle_, ibuf_, buf_[i_],
+		                                      sz, int(reqsize));
+		if (n <= 0)
+			return corrupt(ec);
+
+		auto p = buf_[i_];
+		i_ = !i_;
+		return { p, size_t(n) };
+	}
+
+private:
+	static constexpr size_t reqsize = 65536;
+
+	template <class F>
+	bool read(F&& f, char* p, size_t sz, error_code& ec)
+	{
+		if (end_ - where_ < int64_t(sz))
+		{
+			corrupt(ec);
+			return false;
+		}
+		if (std::forward<F>(f)(p, sz, where_) != sz)
+		{
+			// a short read without an error means a truncated file
+			ec.assign(errno ? errno : EIO, std::system_category());
+			return false;
+		}
+		where_ += int64_t(sz);
+		return true;
+	}
+
+	avail corrupt(error_code& ec)
+	{
+		ec = std::make_error_code(std::errc::illegal_byte_sequence);
+		return { buf_[i_], 0 };
+	}
+
+	LZ4_streamDecode_t handle_[1];
+	char buf_[2][reqsize];
+	char ibuf_[LZ4_COMPRESSBOUND(reqsize)];
+	size_t i_ = 0;
+	int64_t where_, end_;
+};
+
+// Blocks of block_size bytes, each compressed on its own and framed like
+// in lz4_output_pass, followed by the table described at lz4_blocks.  A
+// batch of blocks is read at a time and compressed by run, which may call
+// its function for the blocks in parallel.
+template <class Hasher>
+class lz4_block_output_pass
+{
+public:
+	static constexpr size_t block_size = 65536;
+	using runner =
+	    std::function<void(size_t, std::function<void(size_t)> const&)>;
+
+	explicit lz4_block_output_pass(size_t batch = 1, runner run = nullptr)
+	    : batch_(batch),
+	      run_(std::move(run)),
+	      in_(new char[batch * block_size]),
+	      frames_(batch * frame_size),
+	      lens_(batch)
+	{
+	}
+
+	template <class F>
+	avail make_available(F&& f, error_code& ec)
+	{
+		size_t n = 0;
+		for (; n < batch_ && !eof_; ++n)
+		{
+			auto p = in_.get() + n * block_size;
+			size_t got = 0;
+			while (got < block_size)
+			{
+				auto r = f(p + got, block_size - got, ec);
+				if (ec)
+					return { nullptr, 0 };
+				if (r == 0)
+				{
+					eof_ = true;
+					break;
+				}
+				got += r;
+			}
+			if (got == 0)
+				break;
+			lens_[n] = int(got);
+			total_ += int64_t(got);
+			h_.update(p, got);
+		}
+
+		if (n == 0)
+			return table();
+
+		auto compress = [this](size_t i) {
+			auto p = &frames_[i * frame_size];
+			auto sz = LZ4_compress_default(
+			    in_.get() + i * block_size, p + sizeof(int), lens_[i],
+			    int(frame_size - sizeof(int)));
+			assert(sz != 0);
+			::new (p) int{ sz };
+		};
+		if (run_ && n > 1)
+			run_(n, compress);
+		else
+			for (size_t i = 0; i < n; ++i)
+				compress(i);
+
+		out_.clear();
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto p = &frames_[i * frame_size];
+			int sz;
+			memcpy(&sz, p, sizeof(sz));
+			offsets_.push_back(pos_);
+			pos_ += int64_t(sizeof(int)) + sz;
+			out_.insert(out_.end(), p, p + sizeof(int) + size_t(sz));
+		}
+		return { out_.data(), out_.size() };
+	}
+
+	finfo stat() const
+	{
+		finfo info = {};
+		info.sizeopt = total_;
+		return info;
+	}
+
+	fhash digest() const { return h_.digest(); }
+
+private:
+	static constexpr size_t frame_size =
+	    sizeof(int) + LZ4_COMPRESSBOUND(block_size);
+
+	avail table()
+	{
+		out_.clear();
+		if (written_)
+			return { out_.data(), 0 };
+
+		auto n = int64_t(offsets_.size());
+		auto p = reinterpret_cast<char const*>(offsets_.data());
+		out_.assign(p, p + sizeof(int64_t) * offsets_.size());
+		p = reinterpret_cast<char const*>(&n);
+		out_.insert(out_.end(), p, p + sizeof(n));
+		written_ = true;
+		return { out_.data(), out_.size() };
+	}
+
+	size_t batch_;
+	runner run_;
+	std::unique_ptr<char[]> in_;
+	std::vector<char> frames_;
+	std::vector<int> lens_;
+	std::vector<char> out_;
+	std::vector<int64_t> offsets_;
+	int64_t pos_ = 0;
+	int64_t total_ = 0;
+	bool eof_ = false;
+	bool written_ = false;
+	Hasher h_;
 };
 }
 }
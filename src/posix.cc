@@ -23,175 +23,181 @@
  * SUCH DAMAGE.
  */
 
-#include <lip/lip.h>
-
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include "walker.h"
 
 #include <stack>
-#include <utility>
-#include <new>
+#include <deque>
+#include <map>
 
 namespace lip
 {
 
-class file_descriptor;
+// files no larger than this are read in a single request
+constexpr __off_t small_file_size = 65536;
 
-class directory
+// Archive names of the files with more than one link, by inode.
+class hardlinks
 {
 public:
-	explicit directory(char const* root) : directory(opendir(root)) {}
-
-	auto cd(char const* dirname) -> directory;
-	auto open(char const* basename, int flags) -> file_descriptor;
-
-	auto readlink(int64_t sz, char const* basename) -> std::string
+	static bool wants(struct stat const& st)
 	{
-		std::string buf;
-		buf.resize(size_t(sz + 1));
-
-		auto n = readlinkat(native_handle(), basename, &*buf.begin(),
-		                    buf.size());
-		if (n == -1)
-			throw std::system_error{ errno,
-				                 std::system_category() };
-		else if (n != sz)
-			throw std::runtime_error{ "racy symlink access" };
-
-		buf.resize(size_t(sz));
-		return buf;
+		return S_ISREG(st.st_mode) && st.st_nlink > 1;
 	}
 
-	feature is_executable(char const* basename) const
+	// the name the file was first archived under, if any
+	std::string const* find(struct stat const& st) const
 	{
-		int r = faccessat(native_handle(), basename, X_OK, AT_EACCESS);
-		if (r == -1)
-		{
-			if (errno == EACCES)
-			{
-				errno = 0;
-				return {};
-			}
-			else
-				throw std::system_error{
-					errno, std::system_category()
-				};
-		}
-
-		return feature::executable;
+		if (!wants(st))
+			return nullptr;
+
+		auto it = names_.find(key(st));
+		if (it == names_.end())
+			return nullptr;
+		else
+			return &it->second;
 	}
 
-	DIR* get() const { return d_.get(); }
-
-	int native_handle() const { return dirfd(get()); }
-
-private:
-	explicit directory(DIR* r) : d_(r)
+	void add(struct stat const& st, string_view arcname)
 	{
-		if (d_ == nullptr)
-		{
-			throw std::system_error{ errno,
-				                 std::system_category() };
-		}
+		if (wants(st))
+			names_.emplace(key(st), std::string(arcname));
 	}
 
-	struct dir_close
+private:
+	using key_type = std::pair<dev_t, ino_t>;
+
+	static key_type key(struct stat const& st)
 	{
-		void operator()(DIR* d) const { closedir(d); }
-	};
+		return { st.st_dev, st.st_ino };
+	}
 
-	std::unique_ptr<DIR, dir_close> d_;
+	std::map<key_type, std::string> names_;
 };
 
-class file_descriptor
+// Reads the small regular files of a directory listing ahead of the
+// packer, a ring-full at a time.  Files are taken in listing order;
+// those that `skip` after the first are not read, nor are repeated links
+// in a batch.
+class read_ahead
 {
 public:
-	auto get_reader() const
+	explicit read_ahead(bool use_uring)
 	{
-		return [fd = fd_](char* p, size_t sz, error_code& ec) {
-			auto n = read(fd, p, sz);
-			if (n == -1)
-				ec.assign(errno, std::system_category());
-			return size_t(n);
-		};
+		if (use_uring)
+			ring_ = make_uring(64);
 	}
 
-	file_descriptor(file_descriptor&& other) noexcept : fd_(other.fd_)
-	{
-		other.fd_ = -1;
-	}
+	explicit operator bool() const noexcept { return bool(ring_); }
 
-	file_descriptor& operator=(file_descriptor&& other) noexcept
+	static bool wants(struct stat const& st)
 	{
-		this->~file_descriptor();
-		return *::new (static_cast<void*>(this)) auto(
-		    std::move(other));
+		return S_ISREG(st.st_mode) && st.st_size <= small_file_size;
 	}
 
-	~file_descriptor()
-	{
-		if (fd_ != -1)
-			close(fd_);
-	}
+	void reset() { ahead_.clear(); }
 
-	int release()
+	// returns the file entries[i], reading it along with the next
+	// small files if needed
+	template <class Skip>
+	auto take(directory& dir, std::vector<walker::entry> const& entries,
+	          size_t i, Skip skip) -> std::shared_ptr<slurped>
 	{
-		auto fd = fd_;
-		fd_ = -1;
-		return fd;
-	}
-
-	int native_handle() const { return fd_; }
-
-private:
-	friend class directory;
+		while (!ahead_.empty() && ahead_.front().first < i)
+			ahead_.pop_front();
+#if defined(LIP_HAVE_IO_URING)
+		if (ahead_.empty() || ahead_.front().first != i)
+		{
+			std::vector<size_t> taken;
+			std::vector<char const*> names;
+			std::vector<int64_t> sizes;
+			std::vector<std::pair<dev_t, ino_t>> links;
+			for (auto j = i; j < entries.size() &&
+			                 names.size() < ring_->capacity();
+			     ++j)
+			{
+				auto& st = entries[j].st;
+				if (j > i && (!wants(st) || skip(j)))
+					continue;
+				if (hardlinks::wants(st))
+				{
+					std::pair<dev_t, ino_t> k{ st.st_dev,
+						                   st.st_ino };
+					if (std::find(links.begin(), links.end(),
+					              k) != links.end())
+						continue;
+					links.push_back(k);
+				}
+				taken.push_back(j);
+				names.push_back(entries[j].name.data());
+				sizes.push_back(st.st_size);
+			}
 
-	explicit file_descriptor(int fd) : fd_(fd)
-	{
-		if (fd_ == -1)
-			throw std::system_error{ errno,
+			std::vector<std::shared_ptr<slurped>> v;
+			slurp_all(*ring_, dir.native_handle(), names, sizes, v);
+			ahead_.clear();
+			for (size_t k = 0; k < v.size(); ++k)
+				ahead_.emplace_back(taken[k], std::move(v[k]));
+		}
+#endif
+		auto x = std::move(ahead_.front().second);
+		ahead_.pop_front();
+		if (x->error)
+			throw std::system_error{ x->error,
 				                 std::system_category() };
+		return x;
 	}
 
-	int fd_;
+private:
+	std::unique_ptr<uring> ring_;
+	std::deque<std::pair<size_t, std::shared_ptr<slurped>>> ahead_;
 };
 
-inline auto directory::cd(char const* dirname) -> directory
-{
-	auto file = open(dirname, O_RDONLY | O_NONBLOCK | O_DIRECTORY);
-	directory d(fdopendir(file.native_handle()));
-	file.release();
-	return d;
-}
-
-inline auto directory::open(char const* basename, int flags) -> file_descriptor
-{
-	return file_descriptor(
-	    openat(native_handle(), basename, flags | O_CLOEXEC));
-}
-
-inline bool is_dots(char const* dirname)
+// the entry in the previous archive that a regular file has not changed
+// from, if any; the file must be the one recorded, and an inode changes
+// its ctime whenever it is written or renamed, which touch cannot undo
+static fcard const* unchanged_in(index const& idx, string_view arcname,
+                                 struct stat const& st, feature feat)
 {
-	using namespace stdex::literals;
-	return dirname == "."_sv || dirname == ".."_sv;
+	auto it = idx.find(arcname);
+	if (it == idx.end() || it->type() != ftype::is_regular_file ||
+	    it->size_ != st.st_size ||
+	    it->mtime != archive_clock::from(st.st_mtim) ||
+	    (it->info.flag & finfo::compression_mask) !=
+	        (uint32_t(feat) & finfo::compression_mask))
+		return nullptr;
+
+	auto was = idx.status(*it);
+	if (!was || was->device != uint64_t(st.st_dev) ||
+	    was->inode != uint64_t(st.st_ino) ||
+	    was->ctime != archive_clock::from(st.st_ctim))
+		return nullptr;
+	else
+		return it;
 }
 
-// generates the LIP archive given a directory
-void archive(std::function<write_sig> f, gbpath::param_type src,
-             archive_options opts)
+// generates the LIP archive given a directory; start(pk) begins the output,
+// which already holds the entries of resumed if any
+template <class Start>
+static archive_stats archive_with(Start start, gbpath::param_type src,
+                                  archive_options opts,
+                                  index const* resumed = nullptr)
 {
-	std::stack<std::pair<directory, gbpath>> stk;
-	packer pk;
+	archive_stats stats;
+	stats.entries = 1;
+	walker w(opts);
+	read_ahead ra(opts.io_uring);
+	hardlinks links;
+	std::stack<std::pair<walker::node_ptr, gbpath>> stk;
+	packer pk(opts.packing);
 	struct stat st;
 
-	stk.emplace(directory(src), src);
-	if (fstat(stk.top().first.native_handle(), &st) == -1)
+	stk.emplace(w.add(directory(src)), src);
+	if (fstat(stk.top().first->dir->native_handle(), &st) == -1)
 		throw std::system_error{ errno, std::system_category() };
 
-	pk.start(std::move(f));
+	auto compressed =
+	    (int(opts.feat) & int(feature::lz4_compressed)) != 0;
+	auto kernel_copy = start(pk) && !compressed;
 	pk.add_directory(stk.top().second.friendly_name(),
 	                 archive_clock::from(st.st_mtim),
 					 st.st_size,
@@ -204,37 +210,45 @@ void archive(std::function<write_sig> f, gbpath::param_type src,
 		auto d = std::move(stk.top());
 		stk.pop();
 
-		errno = 0;
-		while (auto entryp = readdir(d.first.get()))
+		auto& entries = w.entries_of(*d.first);
+		auto& dir = *d.first->dir;
+		stats.entries += int64_t(entries.size());
+		stats.syscalls_avoided += d.first->syscalls_avoided;
+		ra.reset();
+
+		// files kept in the resumed archive, or else to copy from the
+		// previous one
+		std::vector<bool> kept(entries.size());
+		std::vector<fcard const*> prior(entries.size());
+		if (resumed || opts.previous.entries)
 		{
-			switch (entryp->d_type)
+			for (size_t i = 0; i < entries.size(); ++i)
 			{
-			case DT_DIR:
-				if (is_dots(entryp->d_name))
+				if (!S_ISREG(entries[i].st.st_mode))
 					continue;
-			case DT_UNKNOWN:
-			case DT_REG:
-			case DT_LNK: break;
-			default: continue;
+				d.second.push_back(entries[i].name.data());
+				auto name = d.second.friendly_name();
+				kept[i] = resumed &&
+				          unchanged_in(*resumed, name,
+				                       entries[i].st, opts.feat);
+				if (!kept[i] && opts.previous.entries)
+					prior[i] = unchanged_in(
+					    *opts.previous.entries, name,
+					    entries[i].st, opts.feat);
+				d.second.pop_back();
 			}
+		}
 
-			if (fstatat(d.first.native_handle(), entryp->d_name,
-			            &st, AT_SYMLINK_NOFOLLOW) == -1)
-				throw std::system_error{
-					errno, std::system_category()
-				};
-
-			if (S_ISDIR(st.st_mode) &&
-			    (opts.one_level || is_dots(entryp->d_name)))
-				continue;
-
-			d.second.push_back(entryp->d_name);
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			auto& e = entries[i];
+			auto& st = e.st;
+			d.second.push_back(e.name.data());
 
 			switch (st.st_mode & S_IFMT)
 			{
 			case S_IFDIR:
-				stk.emplace(d.first.cd(entryp->d_name),
-				            d.second);
+				stk.emplace(e.child, d.second);
 				pk.add_directory(
 				    d.second.friendly_name(),
 				    archive_clock::from(st.st_mtim),
@@ -245,26 +259,122 @@ void archive(std::function<write_sig> f, gbpath::param_type src,
 				break;
 			case S_IFREG:
 			{
-				auto to_copy =
-				    d.first.open(entryp->d_name, O_RDONLY);
-				pk.add_regular_file(
+				pk.set_status(d.second.friendly_name(),
+				              uint64_t(st.st_dev),
+				              uint64_t(st.st_ino),
+				              archive_clock::from(st.st_ctim));
+				if (auto name = links.find(st))
+				{
+					pk.add_hardlink(d.second.friendly_name(),
+					                *name,
+					                archive_clock::from(st.st_mtim),
+					                st.st_size, st.st_uid,
+					                st.st_gid, st.st_mode);
+					++stats.hardlinks;
+					break;
+				}
+				links.add(st, d.second.friendly_name());
+
+				auto feat = opts.feat;
+				if (opts.lean)
+				{
+					feat = feat | executable_by_mode(st);
+					++stats.syscalls_avoided;
+				}
+				else
+					feat = feat | dir.is_executable(
+					                  e.name.data());
+
+				if (kept[i])
+				{
+					++stats.unchanged;
+					break;
+				}
+
+				if (prior[i])
+				{
+					pk.add_regular_file(
+					    d.second.friendly_name(),
+					    archive_clock::from(st.st_mtim),
+					    st.st_size, st.st_uid, st.st_gid,
+					    st.st_mode,
+					    stored_source{ prior[i],
+					                   opts.previous.read,
+					                   opts.previous.fd,
+					                   opts.previous.entries->digest(
+					                       *prior[i]) },
+					    feat);
+					++stats.unchanged;
+					break;
+				}
+
+				if (ra && ra.wants(st))
+				{
+					auto to_copy = ra.take(
+					    dir, entries, i,
+					    [&](size_t j) {
+						    return kept[j] || prior[j] ||
+						           links.find(entries[j].st);
+					    });
+					pk.post_regular_file(
+					    d.second.friendly_name(),
+					    archive_clock::from(st.st_mtim),
+					    st.st_size, st.st_uid, st.st_gid,
+					    st.st_mode,
+					    [=](char* p, size_t sz, error_code& ec) {
+						    return to_copy->read(p, sz, ec);
+					    },
+					    feat);
+					break;
+				}
+
+				auto fd = std::make_shared<file_descriptor>(
+				    dir.open(e.name.data(), O_RDONLY));
+				if (st.st_size > small_file_size &&
+				    (kernel_copy ||
+				     (maybe_sparse(st) && !compressed)))
+				{
+					pk.add_regular_file(
+					    d.second.friendly_name(),
+					    archive_clock::from(st.st_mtim),
+					    st.st_size, st.st_uid, st.st_gid,
+					    st.st_mode,
+					    file_source{ fd->native_handle() }, feat);
+					break;
+				}
+
+				std::function<refill_sig> to_copy;
+				if (opts.lean)
+				{
+					++stats.syscalls_avoided;
+					to_copy = [fd, r = fd->get_sized_reader(
+					                   st.st_size)](
+					              char* p, size_t sz,
+					              error_code& ec) mutable {
+						return r(p, sz, ec);
+					};
+				}
+				else
+					to_copy = [fd](char* p, size_t sz,
+					               error_code& ec) {
+						return fd->get_reader()(p, sz, ec);
+					};
+
+				pk.post_regular_file(
 				    d.second.friendly_name(),
 				    archive_clock::from(st.st_mtim),
                     st.st_size,
                     st.st_uid,
                     st.st_gid,
                     st.st_mode,
-				    to_copy.get_reader(),
-				    d.first.is_executable(entryp->d_name) |
-				        opts.feat);
+				    std::move(to_copy), feat);
 				break;
 			}
 			case S_IFLNK:
 				pk.add_symlink(
 				    d.second.friendly_name(),
 				    archive_clock::from(st.st_mtim),
-				    d.first.readlink(st.st_size,
-				                     entryp->d_name),
+				    dir.readlink(st.st_size, e.name.data()),
 					st.st_size,
 					st.st_uid,
 					st.st_gid,
@@ -274,11 +384,59 @@ void archive(std::function<write_sig> f, gbpath::param_type src,
 
 			d.second.pop_back();
 		}
-		if (errno)
-			throw std::system_error{ errno,
-				                 std::system_category() };
 	}
 
 	pk.finish();
+	stats.packing = pk.stats();
+	return stats;
+}
+
+archive_stats archive(std::function<write_sig> f, gbpath::param_type src,
+                      archive_options opts)
+{
+	return archive_with(
+	    [&](packer& pk) {
+		    if (opts.append)
+			    throw std::invalid_argument{
+				    "cannot append through a function"
+			    };
+		    pk.start(std::move(f));
+		    return false;
+	    },
+	    src, opts);
+}
+
+archive_stats archive(int fd, gbpath::param_type src, archive_options opts)
+{
+	if (!opts.append)
+		return archive_with(
+		    [=](packer& pk) {
+			    pk.start(fd);
+			    return !opts.packing.direct_io;
+		    },
+		    src, opts);
+
+	index resumed(fd);
+	auto size = lseek(fd, 0, SEEK_END);
+	if (size == -1)
+		throw std::system_error{ errno, std::system_category() };
+
+	try
+	{
+		return archive_with(
+		    [=](packer& pk) {
+			    pk.resume(fd);
+			    return true;
+		    },
+		    src, opts, &resumed);
+	}
+	catch (...)
+	{
+		// leaves the old archive as it was, see packer::resume
+		if (ftruncate(fd, size) != 0)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		throw;
+	}
 }
 }
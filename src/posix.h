@@ -0,0 +1,281 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_POSIX_H
+#define _LIP_SRC_POSIX_H
+
+#include <lip/lip.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <new>
+
+namespace lip
+{
+
+class file_descriptor;
+
+class directory
+{
+public:
+	explicit directory(char const* root) : directory(opendir(root)) {}
+
+	auto cd(char const* dirname) -> directory;
+	auto open(char const* basename, int flags) -> file_descriptor;
+
+	auto readlink(int64_t sz, char const* basename) -> std::string
+	{
+		std::string buf;
+		buf.resize(size_t(sz + 1));
+
+		auto n = readlinkat(native_handle(), basename, &*buf.begin(),
+		                    buf.size());
+		if (n == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		else if (n != sz)
+			throw std::runtime_error{ "racy symlink access" };
+
+		buf.resize(size_t(sz));
+		return buf;
+	}
+
+	feature is_executable(char const* basename) const
+	{
+		int r = faccessat(native_handle(), basename, X_OK, AT_EACCESS);
+		if (r == -1)
+		{
+			if (errno == EACCES)
+			{
+				errno = 0;
+				return {};
+			}
+			else
+				throw std::system_error{
+					errno, std::system_category()
+				};
+		}
+
+		return feature::executable;
+	}
+
+	DIR* get() const { return d_.get(); }
+
+	int native_handle() const { return dirfd(get()); }
+
+private:
+	explicit directory(DIR* r) : d_(r)
+	{
+		if (d_ == nullptr)
+		{
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		}
+	}
+
+	struct dir_close
+	{
+		void operator()(DIR* d) const { closedir(d); }
+	};
+
+	std::unique_ptr<DIR, dir_close> d_;
+};
+
+class file_descriptor
+{
+public:
+	auto get_reader() const
+	{
+		return [fd = fd_](char* p, size_t sz, error_code& ec) {
+			auto n = read(fd, p, sz);
+			if (n == -1)
+				ec.assign(errno, std::system_category());
+			return size_t(n);
+		};
+	}
+
+	// Stops once `size` bytes were read or at the end of file, which
+	// saves the zero-length read at the end of a regular file that has
+	// not changed size.  A short read is not taken for the end.
+	auto get_sized_reader(int64_t size) const
+	{
+		return [fd = fd_, left = size](char* p, size_t sz,
+		                               error_code& ec) mutable {
+			if (left <= 0)
+				return size_t(0);
+			auto n = read(fd, p, sz);
+			if (n == -1)
+				ec.assign(errno, std::system_category());
+			else if (n == 0)
+				left = 0;
+			else
+				left -= n;
+			return size_t(n);
+		};
+	}
+
+	file_descriptor(file_descriptor&& other) noexcept : fd_(other.fd_)
+	{
+		other.fd_ = -1;
+	}
+
+	file_descriptor& operator=(file_descriptor&& other) noexcept
+	{
+		this->~file_descriptor();
+		return *::new (static_cast<void*>(this)) auto(
+		    std::move(other));
+	}
+
+	~file_descriptor()
+	{
+		if (fd_ != -1)
+			close(fd_);
+	}
+
+	int release()
+	{
+		auto fd = fd_;
+		fd_ = -1;
+		return fd;
+	}
+
+	int native_handle() const { return fd_; }
+
+private:
+	friend class directory;
+
+	explicit file_descriptor(int fd) : fd_(fd)
+	{
+		if (fd_ == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+	}
+
+	int fd_;
+};
+
+inline auto directory::cd(char const* dirname) -> directory
+{
+	auto file = open(dirname, O_RDONLY | O_NONBLOCK | O_DIRECTORY);
+	directory d(fdopendir(file.native_handle()));
+	file.release();
+	return d;
+}
+
+inline auto directory::open(char const* basename, int flags) -> file_descriptor
+{
+	return file_descriptor(
+	    openat(native_handle(), basename, flags | O_CLOEXEC));
+}
+
+#if defined(STATX_BASIC_STATS)
+// the fields of struct stat that archive() uses
+constexpr unsigned statx_mask = STATX_TYPE | STATX_MODE | STATX_NLINK |
+                                STATX_UID | STATX_GID | STATX_MTIME |
+                                STATX_CTIME | STATX_INO | STATX_SIZE |
+                                STATX_BLOCKS;
+
+inline void from_statx(struct stat& st, struct statx const& stx) noexcept
+{
+	st = {};
+	st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st.st_ino = stx.stx_ino;
+	st.st_mode = stx.stx_mode;
+	st.st_nlink = stx.stx_nlink;
+	st.st_uid = stx.stx_uid;
+	st.st_gid = stx.stx_gid;
+	st.st_size = __off_t(stx.stx_size);
+	st.st_blocks = blkcnt_t(stx.stx_blocks);
+	st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+
+#endif
+
+// whether a regular file may have holes, judging by its allocation
+inline bool maybe_sparse(struct stat const& st)
+{
+	return int64_t(st.st_blocks) * 512 < int64_t(st.st_size);
+}
+
+// What faccessat(X_OK, AT_EACCESS) reports for a regular file, derived
+// from its mode bits.  ACLs are not considered.
+inline feature executable_by_mode(struct stat const& st)
+{
+	static auto const euid = geteuid();
+	// falls back to the primary group if the supplementary groups
+	// cannot be queried
+	static auto const groups = [] {
+		std::vector<gid_t> v;
+		auto n = getgroups(0, nullptr);
+		if (n > 0)
+		{
+			v.resize(size_t(n));
+			n = getgroups(n, v.data());
+			v.resize(n > 0 ? size_t(n) : 0);
+		}
+		v.push_back(getegid());
+		return v;
+	}();
+
+	mode_t bits;
+	if (euid == 0)
+		bits = S_IXUSR | S_IXGRP | S_IXOTH;
+	else if (st.st_uid == euid)
+		bits = S_IXUSR;
+	else if (std::find(groups.begin(), groups.end(), st.st_gid) !=
+	         groups.end())
+		bits = S_IXGRP;
+	else
+		bits = S_IXOTH;
+
+	if (st.st_mode & bits)
+		return feature::executable;
+	else
+		return {};
+}
+
+inline bool is_dots(char const* dirname)
+{
+	using namespace stdex::literals;
+	return dirname == "."_sv || dirname == ".."_sv;
+}
+
+}
+
+#endif
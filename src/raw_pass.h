@@ -48,6 +48,7 @@ public:
 	}
 
 	finfo stat() const { return { { {}, h_.digest() } }; }
+	fhash digest() const { return h_.digest(); }
 
 private:
 	char buf_[65536];
@@ -0,0 +1,282 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_SPILL_H
+#define _LIP_SRC_SPILL_H
+
+#include "coalescing_writer.h"
+
+#include <vvpkg/fd_funcs.h>
+#if defined(_WIN32)
+#include <vvpkg/c_file_funcs.h>
+#endif
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace lip
+{
+namespace io
+{
+
+// An entry in a sorted run, followed by the name_size bytes of its name.
+struct spilled_entry
+{
+	fcard fc;  // without the name
+	int32_t name_size;
+	int32_t has_digest;
+	fhash digest;  // of the original content, see index::digest
+};
+
+// Runs of entries sorted by name in an unnamed temporary file.  Of the
+// entries with the same name, the one in the latest run wins.
+class spill_file
+{
+public:
+	spill_file() : out_(1024 * 1024)
+	{
+#if defined(_WIN32)
+		fp_.reset(tmpfile());
+		fd_ = fp_ ? _fileno(fp_.get()) : -1;
+#else
+		auto dir = getenv("TMPDIR");
+		std::string d = dir && *dir ? dir : "/tmp";
+#if defined(O_TMPFILE)
+		fd_ = ::open(d.data(), O_TMPFILE | O_RDWR, 0600);
+#endif
+		if (fd_ == -1)
+		{
+			auto path = d + "/lip-spill.XXXXXX";
+			fd_ = mkstemp(&path[0]);
+			if (fd_ != -1)
+				::unlink(path.data());
+		}
+#endif
+		if (fd_ == -1)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+		out_.target(fd_);
+	}
+
+	spill_file(spill_file const&) = delete;
+	spill_file& operator=(spill_file const&) = delete;
+
+	~spill_file()
+	{
+#if !defined(_WIN32)
+		::close(fd_);
+#endif
+	}
+
+	void begin_run() { runs_.push_back({ size_, size_, {} }); }
+
+	// entries must come in ascending order of their names
+	void append(spilled_entry const& e, string_view name)
+	{
+		auto& r = runs_.back();
+		if (r.n++ % sample_every == 0)
+			r.samples.push_back(size_);
+		out_.write(reinterpret_cast<char const*>(&e), sizeof(e));
+		out_.write(name.data(), name.size());
+		size_ += int64_t(sizeof(e) + name.size());
+	}
+
+	void end_run()
+	{
+		out_.flush();
+		runs_.back().end = size_;
+	}
+
+	bool empty() const { return runs_.empty(); }
+
+	// looks up the latest entry under name
+	bool find(string_view arcname, spilled_entry& e) const
+	{
+		std::string name(arcname.data(), arcname.size());
+		for (auto r = runs_.rbegin(); r != runs_.rend(); ++r)
+		{
+			auto it = std::upper_bound(
+			    r->samples.begin(), r->samples.end(), name,
+			    [&](std::string const& s, int64_t off) {
+				    cursor c(fd_, off, r->end);
+				    c.next();
+				    return s < c.name();
+			    });
+			if (it == r->samples.begin())
+				continue;
+
+			cursor c(fd_, *(it - 1), r->end);
+			for (size_t i = 0; i < sample_every && c.next(); ++i)
+			{
+				if (c.name() == name)
+				{
+					e = c.entry();
+					return true;
+				}
+				else if (name < c.name())
+					break;
+			}
+		}
+		return false;
+	}
+
+	// calls fn(entry, name) on the winning entries in order of names
+	template <class F>
+	void merge(F&& fn) const
+	{
+		std::vector<cursor> cs;
+		cs.reserve(runs_.size());
+		std::vector<size_t> heap;
+		for (auto& r : runs_)
+		{
+			cs.emplace_back(fd_, r.begin, r.end);
+			if (cs.back().next())
+				heap.push_back(cs.size() - 1);
+		}
+
+		// a min-heap by name, the latest run first among equals
+		auto after = [&](size_t a, size_t b) {
+			auto c = cs[a].name().compare(cs[b].name());
+			return c > 0 || (c == 0 && a < b);
+		};
+		auto advance = [&](size_t i) {
+			if (cs[i].next())
+			{
+				heap.push_back(i);
+				std::push_heap(heap.begin(), heap.end(), after);
+			}
+		};
+
+		std::make_heap(heap.begin(), heap.end(), after);
+		std::string last;
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), after);
+			auto i = heap.back();
+			heap.pop_back();
+			fn(cs[i].entry(), cs[i].name());
+			last = cs[i].name();
+			advance(i);
+
+			while (!heap.empty() && cs[heap.front()].name() == last)
+			{
+				std::pop_heap(heap.begin(), heap.end(), after);
+				auto j = heap.back();
+				heap.pop_back();
+				advance(j);
+			}
+		}
+	}
+
+private:
+	static constexpr size_t sample_every = 256;
+
+	struct run
+	{
+		int64_t begin, end;
+		std::vector<int64_t> samples;  // offsets of every sample_every'th
+		size_t n = 0;
+	};
+
+	// reads the entries of a run from off
+	class cursor
+	{
+	public:
+		cursor(int fd, int64_t off, int64_t end)
+		    : f_(vvpkg::from_seekable_descriptor(fd)), off_(off),
+		      end_(end)
+		{
+		}
+
+		bool next()
+		{
+			if (pos_ == len_ && off_ == end_)
+				return false;
+			read(&e_, sizeof(e_));
+			name_.resize(size_t(e_.name_size));
+			read(&name_[0], name_.size());
+			return true;
+		}
+
+		spilled_entry const& entry() const { return e_; }
+		std::string const& name() const { return name_; }
+
+	private:
+		void read(void* p, size_t sz)
+		{
+			auto to = static_cast<char*>(p);
+			while (sz != 0)
+			{
+				if (pos_ == len_)
+					refill();
+				auto n = std::min(sz, len_ - pos_);
+				memcpy(to, buf_.get() + pos_, n);
+				pos_ += n;
+				to += n;
+				sz -= n;
+			}
+		}
+
+		void refill()
+		{
+			if (!buf_)
+				buf_.reset(new char[buffer_size]);
+			auto n = size_t(
+			    std::min(end_ - off_, int64_t(buffer_size)));
+			if (n == 0 || f_(buf_.get(), n, off_) != n)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+			off_ += int64_t(n);
+			pos_ = 0;
+			len_ = n;
+		}
+
+		static constexpr size_t buffer_size = 64 * 1024;
+
+		decltype(vvpkg::from_seekable_descriptor(0)) f_;
+		int64_t off_, end_;
+		std::unique_ptr<char[]> buf_;
+		size_t pos_ = 0, len_ = 0;
+		spilled_entry e_;
+		std::string name_;
+	};
+
+#if defined(_WIN32)
+	std::unique_ptr<FILE, vvpkg::c_file_deleter> fp_;
+#endif
+	int fd_ = -1;
+	coalescing_writer out_;
+	int64_t size_ = 0;
+	std::vector<run> runs_;
+};
+
+}
+}
+
+#endif
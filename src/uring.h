@@ -0,0 +1,387 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_URING_H
+#define _LIP_SRC_URING_H
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define LIP_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "posix.h"
+
+#include <string.h>
+#include <vector>
+
+namespace lip
+{
+
+#if defined(LIP_HAVE_IO_URING)
+
+// A minimal io_uring driver for batches of independent operations: prepare
+// up to capacity() entries, then run() submits them in one system call and
+// reaps all of their completions.
+class uring
+{
+public:
+	explicit uring(unsigned entries) noexcept
+	{
+		io_uring_params p = {};
+		fd_ = int(syscall(__NR_io_uring_setup, entries, &p));
+		if (fd_ == -1)
+			return;
+
+		sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_len_ = cq_len_ = (std::max)(sq_len_, cq_len_);
+		sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+
+		sq_ = map(sq_len_, IORING_OFF_SQ_RING);
+		cq_ = (p.features & IORING_FEAT_SINGLE_MMAP)
+		          ? sq_
+		          : map(cq_len_, IORING_OFF_CQ_RING);
+		sqes_ = static_cast<io_uring_sqe*>(
+		    map(sqes_len_, IORING_OFF_SQES));
+		if (sq_ == MAP_FAILED || cq_ == MAP_FAILED ||
+		    sqes_ == MAP_FAILED || !supports_file_ops())
+		{
+			release();
+			return;
+		}
+
+		capacity_ = p.sq_entries;
+		sq_head_ = at<unsigned>(sq_, p.sq_off.head);
+		sq_tail_ = at<unsigned>(sq_, p.sq_off.tail);
+		sq_mask_ = *at<unsigned>(sq_, p.sq_off.ring_mask);
+		sq_array_ = at<unsigned>(sq_, p.sq_off.array);
+		cq_head_ = at<unsigned>(cq_, p.cq_off.head);
+		cq_tail_ = at<unsigned>(cq_, p.cq_off.tail);
+		cq_mask_ = *at<unsigned>(cq_, p.cq_off.ring_mask);
+		cqes_ = at<io_uring_cqe>(cq_, p.cq_off.cqes);
+	}
+
+	uring(uring const&) = delete;
+	uring& operator=(uring const&) = delete;
+
+	~uring() { release(); }
+
+	explicit operator bool() const noexcept { return fd_ != -1; }
+
+	unsigned capacity() const noexcept { return capacity_; }
+
+	auto prep(int opcode, int fd, uint64_t user_data) -> io_uring_sqe&
+	{
+		auto tail = *sq_tail_ + pending_;
+		auto& sqe = sqes_[tail & sq_mask_];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = uint8_t(opcode);
+		sqe.fd = fd;
+		sqe.user_data = user_data;
+		sq_array_[tail & sq_mask_] = tail & sq_mask_;
+		++pending_;
+		return sqe;
+	}
+
+	// submits the prepared entries and calls f(user_data, result) for
+	// each of them
+	template <class F>
+	void run(F&& f)
+	{
+		unsigned n = pending_;
+		__atomic_store_n(sq_tail_, *sq_tail_ + n, __ATOMIC_RELEASE);
+		pending_ = 0;
+
+		while (n != 0)
+		{
+			auto unsubmitted =
+			    *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+			if (syscall(__NR_io_uring_enter, fd_, unsubmitted, n,
+			            IORING_ENTER_GETEVENTS, nullptr, 0) == -1 &&
+			    errno != EINTR)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+
+			auto head = *cq_head_;
+			auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head, --n)
+			{
+				auto& cqe = cqes_[head & cq_mask_];
+				f(cqe.user_data, cqe.res);
+			}
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+		}
+	}
+
+private:
+	void* map(size_t len, off_t what) noexcept
+	{
+		return mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		            MAP_SHARED | MAP_POPULATE, fd_, what);
+	}
+
+	template <class T>
+	static T* at(void* base, unsigned offset)
+	{
+		return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+	}
+
+	bool supports_file_ops() noexcept
+	{
+		constexpr unsigned nops = IORING_OP_LAST;
+		std::vector<char> buf(sizeof(io_uring_probe) +
+		                      nops * sizeof(io_uring_probe_op));
+		auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+		if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE,
+		            probe, nops) == -1)
+			return false;
+
+		for (int op : { IORING_OP_OPENAT, IORING_OP_STATX,
+		                IORING_OP_READ, IORING_OP_CLOSE })
+		{
+			if (op > probe->last_op ||
+			    !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+		return true;
+	}
+
+	void release() noexcept
+	{
+		if (sqes_ != nullptr && sqes_ != MAP_FAILED)
+			munmap(sqes_, sqes_len_);
+		if (cq_ != nullptr && cq_ != MAP_FAILED && cq_ != sq_)
+			munmap(cq_, cq_len_);
+		if (sq_ != nullptr && sq_ != MAP_FAILED)
+			munmap(sq_, sq_len_);
+		if (fd_ != -1)
+			close(fd_);
+		fd_ = -1;
+	}
+
+	int fd_ = -1;
+	unsigned capacity_ = 0, pending_ = 0;
+	void *sq_ = nullptr, *cq_ = nullptr;
+	io_uring_sqe* sqes_ = nullptr;
+	size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+	unsigned *sq_head_, *sq_tail_, *sq_array_, *cq_head_, *cq_tail_;
+	unsigned sq_mask_, cq_mask_;
+	io_uring_cqe* cqes_;
+};
+
+#else
+
+class uring
+{
+public:
+	explicit uring(unsigned) noexcept {}
+	explicit operator bool() const noexcept { return false; }
+};
+
+#endif
+
+// a ring, or null if io_uring is unavailable
+inline auto make_uring(unsigned entries) -> std::unique_ptr<uring>
+{
+	std::unique_ptr<uring> r(new uring(entries));
+	if (!*r)
+		r.reset();
+	return r;
+}
+
+#if defined(LIP_HAVE_IO_URING)
+
+// stats basenames relative to dirfd, capacity() at a time
+inline void stat_all(uring& ring, int dirfd,
+                     std::vector<std::string> const& names,
+                     std::vector<struct stat>& out)
+{
+	std::vector<struct statx> stx(ring.capacity());
+	out.resize(names.size());
+
+	for (size_t from = 0; from < names.size(); from += stx.size())
+	{
+		auto n = (std::min)(stx.size(), names.size() - from);
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto& sqe = ring.prep(IORING_OP_STATX, dirfd, i);
+			sqe.addr = uint64_t(names[from + i].data());
+			sqe.len = statx_mask;
+			sqe.off = uint64_t(&stx[i]);
+			sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+		}
+
+		int err = 0;
+		ring.run([&](uint64_t i, int32_t res) {
+			if (res < 0)
+				err = -res;
+			else
+				from_statx(out[from + i], stx[i]);
+		});
+		if (err)
+			throw std::system_error{ err, std::system_category() };
+	}
+}
+
+#endif
+
+// Contents of a small file read ahead of the packer.  If the file turned
+// out to be larger than its stat size, fd is left open and positioned
+// after data.
+struct slurped
+{
+	slurped() = default;
+	slurped(slurped const&) = delete;
+	slurped& operator=(slurped const&) = delete;
+
+	~slurped()
+	{
+		if (fd != -1)
+			close(fd);
+	}
+
+	size_t read(char* p, size_t sz, error_code& ec)
+	{
+		if (pos < data.size())
+		{
+			auto n = (std::min)(sz, data.size() - pos);
+			memcpy(p, data.data() + pos, n);
+			pos += n;
+			return n;
+		}
+		else if (fd == -1)
+			return 0;
+
+		auto n = ::read(fd, p, sz);
+		if (n == -1)
+			ec.assign(errno, std::system_category());
+		return size_t(n);
+	}
+
+	std::string data;
+	size_t pos = 0;
+	int fd = -1;
+	int error = 0;
+};
+
+#if defined(LIP_HAVE_IO_URING)
+
+// opens, reads and closes files relative to dirfd in three batched
+// submissions, at most capacity() files at a time; sizes are the
+// expected file sizes
+inline void slurp_all(uring& ring, int dirfd,
+                      std::vector<char const*> const& names,
+                      std::vector<int64_t> const& sizes,
+                      std::vector<std::shared_ptr<slurped>>& out)
+{
+	auto n = names.size();
+	out.clear();
+	for (size_t i = 0; i < n; ++i)
+	{
+		out.push_back(std::make_shared<slurped>());
+		auto& sqe = ring.prep(IORING_OP_OPENAT, dirfd, i);
+		sqe.addr = uint64_t(names[i]);
+		sqe.open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	ring.run([&](uint64_t i, int32_t res) {
+		if (res < 0)
+			out[i]->error = -res;
+		else
+			out[i]->fd = res;
+	});
+
+	// a read may come back short before the end of file, so read again
+	// from where it stopped until one returns 0 or the buffer is full
+	std::vector<size_t> filled(n);
+	std::vector<bool> reading(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (out[i]->fd == -1)
+			continue;
+		out[i]->data.resize(size_t(sizes[i]) + 1);
+		reading[i] = true;
+	}
+	for (;;)
+	{
+		bool more = false;
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (!reading[i])
+				continue;
+			auto& x = *out[i];
+			auto& sqe = ring.prep(IORING_OP_READ, x.fd, i);
+			sqe.addr = uint64_t(x.data.data() + filled[i]);
+			sqe.len = unsigned(x.data.size() - filled[i]);
+			sqe.off = filled[i];
+			more = true;
+		}
+		if (!more)
+			break;
+		ring.run([&](uint64_t i, int32_t res) {
+			if (res < 0)
+			{
+				out[i]->error = -res;
+				reading[i] = false;
+			}
+			else if (res == 0)
+				reading[i] = false;
+			else if ((filled[i] += size_t(res)) ==
+			         out[i]->data.size())
+				reading[i] = false;
+		});
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (out[i]->error)
+			out[i]->data.clear();
+		else
+			out[i]->data.resize(filled[i]);
+	}
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		auto& x = *out[i];
+		if (x.fd == -1)
+			continue;
+		else if (x.error || int64_t(x.data.size()) <= sizes[i])
+		{
+			ring.prep(IORING_OP_CLOSE, x.fd, i);
+			x.fd = -1;
+		}
+		else if (lseek(x.fd, off_t(x.data.size()), SEEK_SET) == -1)
+			x.error = errno;
+	}
+	ring.run([](uint64_t, int32_t) {});
+}
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,431 @@
+/*-
+ * Copyright (c) 2018 Zhihao Yuan.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIP_SRC_WALKER_H
+#define _LIP_SRC_WALKER_H
+
+#include "uring.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lip
+{
+
+// Lists directories ahead of the consumer on a pool of threads.  Each
+// thread owns a deque of directories to list; it pops from the back of its
+// own deque and steals from the front of the others.  The consumer visits
+// the listings in the same order as a serial walk would, so the archive
+// does not depend on how the work was scheduled.  With no threads, every
+// directory is listed by the consumer when it gets there.  A directory is
+// opened only when it is listed, and the threads stop listing once
+// lookahead directories are waiting for the consumer, so that neither the
+// open descriptors nor the buffered entries grow with the tree.
+class walker
+{
+public:
+	struct node;
+	using node_ptr = std::shared_ptr<node>;
+
+	struct entry
+	{
+		std::string name;
+		struct stat st;
+		node_ptr child;
+	};
+
+	struct node
+	{
+		explicit node(directory d)
+		    : dir(std::make_shared<directory>(std::move(d)))
+		{
+		}
+
+		node(std::shared_ptr<directory> parent, std::string name)
+		    : parent(std::move(parent)), name(std::move(name))
+		{
+		}
+
+		// opened from parent and name when listed
+		std::shared_ptr<directory> dir;
+		std::shared_ptr<directory> parent;
+		std::string name;
+		std::vector<entry> entries;
+		std::exception_ptr error;
+		int64_t syscalls_avoided = 0;
+		std::atomic<int> state{ pending };
+		// listed by a thread of the pool
+		bool ahead = false;
+	};
+
+	explicit walker(archive_options const& opts)
+	    : one_level_(opts.one_level), use_uring_(opts.io_uring),
+	      lean_(opts.lean)
+	{
+		if (use_uring_)
+			ring_ = make_uring(ring_size);
+		for (int i = 0; i < opts.walkers; ++i)
+			queues_.emplace_back(new queue);
+		for (size_t i = 0; i < queues_.size(); ++i)
+			threads_.emplace_back([=] { run(i); });
+	}
+
+	walker(walker const&) = delete;
+	walker& operator=(walker const&) = delete;
+
+	~walker()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mu_);
+			stop_ = true;
+		}
+		idle_.notify_all();
+		for (auto& t : threads_)
+			t.join();
+	}
+
+	auto add(directory d) -> node_ptr
+	{
+		auto n = std::make_shared<node>(std::move(d));
+		push(n, next_++);
+		return n;
+	}
+
+	// waits for the listing of n, listing it on the calling thread if no
+	// worker has started on it yet
+	auto entries_of(node& n) -> std::vector<entry> const&
+	{
+		if (claim(n))
+			list(n, next_++, ring_.get());
+		else
+		{
+			std::unique_lock<std::mutex> lk(mu_);
+			ready_.wait(lk, [&] { return n.state == done; });
+			if (n.ahead)
+			{
+				--ahead_;
+				lk.unlock();
+				idle_.notify_all();
+			}
+		}
+
+		if (n.error)
+			std::rethrow_exception(n.error);
+		return n.entries;
+	}
+
+private:
+	enum
+	{
+		pending,
+		running,
+		done,
+	};
+
+	static constexpr unsigned ring_size = 256;
+	static constexpr size_t lookahead = 64;
+	// what readdir(3) asks getdents64 for in glibc
+	static constexpr size_t dirent_buffer_size = 32768;
+	static constexpr size_t lean_dirent_buffer_size = 1024 * 1024;
+
+	// the consumer owns the nodes, so that the ones it has visited
+	// close their directories even when still queued
+	struct queue
+	{
+		std::mutex mu;
+		std::deque<std::weak_ptr<node>> q;
+	};
+
+	static bool claim(node& n)
+	{
+		int expected = pending;
+		return n.state.compare_exchange_strong(expected, running);
+	}
+
+	void push(node_ptr const& n, size_t hint)
+	{
+		if (queues_.empty())
+			return;
+
+		auto& qu = *queues_[hint % queues_.size()];
+		{
+			std::lock_guard<std::mutex> lk(qu.mu);
+			qu.q.push_back(n);
+		}
+		{
+			std::lock_guard<std::mutex> lk(mu_);
+			++queued_;
+		}
+		idle_.notify_one();
+	}
+
+	// returns null if the node popped is gone or if none is queued
+	auto pop(size_t self) -> node_ptr
+	{
+		node_ptr n;
+		bool popped = false;
+		for (size_t i = 0; i < queues_.size() && !popped; ++i)
+		{
+			auto& qu = *queues_[(self + i) % queues_.size()];
+			std::lock_guard<std::mutex> lk(qu.mu);
+			if (qu.q.empty())
+				continue;
+			else if (i == 0)
+			{
+				n = qu.q.back().lock();
+				qu.q.pop_back();
+			}
+			else
+			{
+				n = qu.q.front().lock();
+				qu.q.pop_front();
+			}
+			popped = true;
+		}
+
+		if (popped)
+		{
+			std::lock_guard<std::mutex> lk(mu_);
+			--queued_;
+		}
+		return n;
+	}
+
+	void run(size_t self)
+	{
+		std::unique_ptr<uring> ring;
+		if (use_uring_)
+			ring = make_uring(ring_size);
+
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lk(mu_);
+				idle_.wait(lk, [&] {
+					return stop_ ||
+					       (queued_ != 0 && ahead_ < lookahead);
+				});
+				if (stop_)
+					break;
+				++ahead_;
+			}
+
+			auto n = pop(self);
+			if (n && claim(*n))
+			{
+				n->ahead = true;
+				list(*n, self, ring.get());
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lk(mu_);
+				--ahead_;
+			}
+		}
+	}
+
+	static bool is_listed(unsigned char d_type, char const* name)
+	{
+		switch (d_type)
+		{
+		case DT_DIR: return !is_dots(name);
+		case DT_UNKNOWN:
+		case DT_REG:
+		case DT_LNK: return true;
+		default: return false;
+		}
+	}
+
+	static void read_names(node& n, std::vector<std::string>& names)
+	{
+		errno = 0;
+		while (auto entryp = readdir(n.dir->get()))
+		{
+			if (is_listed(entryp->d_type, entryp->d_name))
+				names.emplace_back(entryp->d_name);
+		}
+		if (errno)
+			throw std::system_error{ errno,
+				                 std::system_category() };
+	}
+
+	// reads the names with a few large getdents64 calls on the
+	// descriptor, leaving the DIR stream untouched
+	static void read_names_lean(node& n, std::vector<std::string>& names)
+	{
+#if defined(__linux__)
+		struct linux_dirent64
+		{
+			uint64_t d_ino;
+			int64_t d_off;
+			unsigned short d_reclen;
+			unsigned char d_type;
+			char d_name[1];
+		};
+
+		thread_local std::vector<char> buf(lean_dirent_buffer_size);
+		int64_t calls = 0, total = 0;
+		for (;;)
+		{
+			auto r = syscall(SYS_getdents64, n.dir->native_handle(),
+			                 buf.data(), buf.size());
+			++calls;
+			if (r == -1)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+			else if (r == 0)
+				break;
+
+			total += r;
+			for (long pos = 0; pos < r;)
+			{
+				auto d = reinterpret_cast<linux_dirent64*>(
+				    buf.data() + pos);
+				if (is_listed(d->d_type, d->d_name))
+					names.emplace_back(d->d_name);
+				pos += d->d_reclen;
+			}
+		}
+
+		auto readdir_calls =
+		    (total + int64_t(dirent_buffer_size) - 1) /
+		        int64_t(dirent_buffer_size) +
+		    1;
+		n.syscalls_avoided += (std::max)(readdir_calls - calls,
+		                                 int64_t(0));
+#else
+		read_names(n, names);
+#endif
+	}
+
+	void stat_names(node& n, std::vector<std::string> const& names,
+	                std::vector<struct stat>& sts)
+	{
+		sts.resize(names.size());
+		for (size_t i = 0; i < names.size(); ++i)
+		{
+			int r;
+#if defined(STATX_BASIC_STATS)
+			if (lean_)
+			{
+				struct statx stx;
+				r = statx(n.dir->native_handle(), names[i].data(),
+				          AT_SYMLINK_NOFOLLOW, statx_mask, &stx);
+				if (r != -1)
+					from_statx(sts[i], stx);
+			}
+			else
+#endif
+				r = fstatat(n.dir->native_handle(),
+				            names[i].data(), &sts[i],
+				            AT_SYMLINK_NOFOLLOW);
+			if (r == -1)
+				throw std::system_error{
+					errno, std::system_category()
+				};
+		}
+	}
+
+	void list(node& n, size_t self, uring* ring)
+	{
+		try
+		{
+			if (!n.dir)
+			{
+				n.dir = std::make_shared<directory>(
+				    n.parent->cd(n.name.data()));
+				n.parent.reset();
+			}
+
+			std::vector<std::string> names;
+			std::vector<struct stat> sts;
+			if (lean_)
+				read_names_lean(n, names);
+			else
+				read_names(n, names);
+
+#if defined(LIP_HAVE_IO_URING)
+			if (ring)
+				stat_all(*ring, n.dir->native_handle(), names,
+				         sts);
+			else
+#endif
+				stat_names(n, names, sts);
+
+			for (size_t i = 0; i < names.size(); ++i)
+				add(n, std::move(names[i]), sts[i], self);
+		}
+		catch (...)
+		{
+			n.error = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(mu_);
+			n.state = done;
+		}
+		ready_.notify_all();
+	}
+
+	void add(node& n, std::string name, struct stat const& st,
+	         size_t self)
+	{
+		if (S_ISDIR(st.st_mode) &&
+		    (one_level_ || is_dots(name.data())))
+			return;
+
+		n.entries.push_back({ std::move(name), st, {} });
+		if (S_ISDIR(st.st_mode))
+		{
+			auto& e = n.entries.back();
+			e.child = std::make_shared<node>(n.dir, e.name);
+			push(e.child, self);
+		}
+	}
+
+	bool one_level_;
+	bool use_uring_;
+	bool lean_;
+	std::unique_ptr<uring> ring_;
+	std::atomic<bool> stop_{ false };
+	size_t queued_ = 0;
+	// nodes listed by the pool and not yet taken by entries_of
+	size_t ahead_ = 0;
+	size_t next_ = 0;
+	std::mutex mu_;
+	std::condition_variable idle_, ready_;
+	std::vector<std::unique_ptr<queue>> queues_;
+	std::vector<std::thread> threads_;
+};
+
+}
+
+#endif
@@ -27,8 +27,14 @@
 
 namespace lip
 {
-void archive(std::function<write_sig> f, gbpath::param_type src,
-             archive_options opts)
+archive_stats archive(std::function<write_sig> f, gbpath::param_type src,
+                      archive_options opts)
 {
+	return {};
+}
+
+archive_stats archive(int fd, gbpath::param_type src, archive_options opts)
+{
+	return {};
 }
 }
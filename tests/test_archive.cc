@@ -0,0 +1,409 @@
+#include "doctest.h"
+
+#include <lip/lip.h>
+#include <vvpkg/fd_funcs.h>
+#include <stdex/defer.h>
+#include <stdex/hashlib.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define U(s) L##s
+#else
+#define U(s) s
+#endif
+
+using namespace stdex::literals;
+using stdex::string_view;
+
+static std::string archive_to_string(lip::archive_options opts,
+                                     lip::archive_stats* st = nullptr,
+                                     lip::gbpath::param_type src = U("3rdparty"))
+{
+	std::string s;
+	auto r = lip::archive(
+	    [&](char const* p, size_t sz) {
+		    s.append(p, sz);
+		    return sz;
+	    },
+	    src, opts);
+	if (st)
+		*st = r;
+	return s;
+}
+
+template <class F>
+static std::string content_of(F f, lip::fcard const& fc)
+{
+	std::string s;
+	lip::content(f).copy(fc, [&](char const* p, size_t sz) {
+		s.append(p, sz);
+		return sz;
+	});
+	return s;
+}
+
+TEST_CASE("archive")
+{
+	lip::archive_options opts;
+	auto s = archive_to_string(opts);
+
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s.copy(p, sz, size_t(from));
+	};
+	auto idx = lip::index(f, int64_t(s.size()), nullptr);
+	REQUIRE(idx.find("3rdparty/include/cedar/COPYING"_sv) != idx.end());
+
+	SUBCASE("parallel walk")
+	{
+		for (int n : { 1, 2, 8 })
+		{
+			opts.walkers = n;
+			REQUIRE(archive_to_string(opts) == s);
+		}
+	}
+
+	SUBCASE("io_uring ingestion")
+	{
+		opts.io_uring = true;
+		REQUIRE(archive_to_string(opts) == s);
+		opts.walkers = 2;
+		REQUIRE(archive_to_string(opts) == s);
+	}
+
+	SUBCASE("lean walk")
+	{
+		lip::archive_stats st;
+		opts.lean = true;
+		REQUIRE(archive_to_string(opts, &st) == s);
+		REQUIRE(st.entries == idx.size());
+		REQUIRE(st.syscalls_avoided > 0);
+	}
+
+#ifndef _WIN32
+	SUBCASE("to a descriptor")
+	{
+		char fn[] = "lip__test_archive.tmp";
+		lip::archive_stats st;
+		{
+			auto fd = vvpkg::xopen_for_write(fn);
+			defer(vvpkg::xclose(fd));
+			st = lip::archive(fd, U("3rdparty"), opts);
+		}
+
+		std::ostringstream os;
+		os << std::ifstream(fn, std::ios::binary).rdbuf();
+		::remove(fn);
+		REQUIRE(os.str() == s);
+		REQUIRE(st.packing.bytes_copied > 0);
+	}
+#endif
+
+	SUBCASE("pipelined")
+	{
+		opts.packing.jobs = 4;
+		auto s2 = archive_to_string(opts);
+		REQUIRE(s2.size() == s.size());
+
+		auto f2 = [&](char* p, size_t sz, int64_t from) {
+			return s2.copy(p, sz, size_t(from));
+		};
+		auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+		REQUIRE(idx2.size() == idx.size());
+		for (int i = 0; i < idx.size(); ++i)
+		{
+			REQUIRE(idx2[i].arcname == string_view(idx[i].arcname));
+			REQUIRE(idx2[i].info.digest == idx[i].info.digest);
+			REQUIRE(idx2[i].size() == idx[i].size());
+			REQUIRE(content_of(f2, idx2[i]) == content_of(f, idx[i]));
+		}
+	}
+
+	SUBCASE("lz4 decoding")
+	{
+		for (auto feat : { lip::feature::lz4_compressed,
+		                   lip::feature::lz4_compressed |
+		                       lip::feature::lz4_blocks })
+		{
+			opts.feat = feat;
+			auto s2 = archive_to_string(opts);
+			auto f2 = [&](char* p, size_t sz, int64_t from) {
+				return s2.copy(p, sz, size_t(from));
+			};
+			auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+			REQUIRE(idx2.size() == idx.size());
+			for (int i = 0; i < idx.size(); ++i)
+			{
+				if (idx[i].type() != lip::ftype::is_regular_file)
+					continue;
+				REQUIRE(idx2[i].is_lz4_compressed());
+				REQUIRE(idx2.digest(idx2[i]) != nullptr);
+				REQUIRE(*idx2.digest(idx2[i]) == idx[i].info.digest);
+				auto x = content_of(f, idx[i]);
+				REQUIRE(content_of(f2, idx2[i]) == x);
+
+				for (auto from : { int64_t(1), int64_t(65536),
+				                   int64_t(70000), int64_t(x.size()) })
+				{
+					std::string y;
+					lip::content(f2).copy(
+					    idx2[i], from, [&](char const* p, size_t sz) {
+						    y.append(p, sz);
+						    return sz;
+					    });
+					REQUIRE(y == x.substr(std::min(size_t(from),
+					                               x.size())));
+				}
+			}
+		}
+	}
+
+	SUBCASE("incremental")
+	{
+		lip::archive_stats st;
+		opts.previous = { &idx, f };
+		REQUIRE(archive_to_string(opts, &st) == s);
+		REQUIRE(st.unchanged ==
+		        std::count_if(idx.begin(), idx.end(),
+		                      [](lip::fcard const& fc) {
+			                      return fc.type() ==
+			                             lip::ftype::is_regular_file;
+		                      }));
+
+		opts.feat = lip::feature::lz4_compressed;
+		auto s2 = archive_to_string(opts, &st);
+		REQUIRE(st.unchanged == 0);
+
+		// digests of compressed entries survive reuse
+		auto f2 = [&](char* p, size_t sz, int64_t from) {
+			return s2.copy(p, sz, size_t(from));
+		};
+		auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+		opts.previous = { &idx2, f2 };
+		REQUIRE(archive_to_string(opts, &st) == s2);
+		REQUIRE(st.unchanged > 0);
+	}
+
+#ifndef _WIN32
+	SUBCASE("hardlinks")
+	{
+		auto write = [](char const* fn, string_view x) {
+			std::ofstream(fn, std::ios::binary)
+			    .write(x.data(), std::streamsize(x.size()));
+		};
+		::mkdir("lip__test_links", 0755);
+		::mkdir("lip__test_links/sub", 0755);
+		write("lip__test_links/a", "shared");
+		write("lip__test_links/d", "shared");
+		REQUIRE(::link("lip__test_links/a", "lip__test_links/b") == 0);
+		REQUIRE(::link("lip__test_links/a", "lip__test_links/sub/c") ==
+		        0);
+		defer(::remove("lip__test_links/sub/c");
+		      ::remove("lip__test_links/sub"); ::remove("lip__test_links/a");
+		      ::remove("lip__test_links/b"); ::remove("lip__test_links/d");
+		      ::remove("lip__test_links"));
+
+		lip::archive_options variants[4];
+		variants[1].io_uring = true;
+		variants[2].packing.jobs = 2;
+		variants[3].lean = true;
+		for (auto& o : variants)
+		{
+			lip::archive_stats st;
+			auto s2 = archive_to_string(o, &st, "lip__test_links");
+			auto f2 = [&](char* p, size_t sz, int64_t from) {
+				return s2.copy(p, sz, size_t(from));
+			};
+			auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+			REQUIRE(st.hardlinks == 2);
+
+			auto& a = idx2["lip__test_links/a"];
+			for (auto name : { "lip__test_links/b"_sv,
+			                   "lip__test_links/sub/c"_sv })
+			{
+				auto& x = idx2[name];
+				REQUIRE(x.begin.offset == a.begin.offset);
+				REQUIRE(x.end.offset == a.end.offset);
+				REQUIRE(x.info.digest == a.info.digest);
+			}
+			auto& d = idx2["lip__test_links/d"];
+			REQUIRE(d.begin.offset != a.begin.offset);
+			REQUIRE(content_of(f2, d) == content_of(f2, a));
+		}
+	}
+
+	SUBCASE("replaced files are read again")
+	{
+		::mkdir("lip__test_replaced", 0755);
+		std::ofstream("lip__test_replaced/a", std::ios::binary) << "old";
+		std::ofstream("lip__test_replaced/b", std::ios::binary) << "new";
+		defer(::remove("lip__test_replaced/a");
+		      ::remove("lip__test_replaced/b");
+		      ::rmdir("lip__test_replaced"));
+
+		lip::archive_stats st;
+		auto s2 = archive_to_string(opts, &st, "lip__test_replaced");
+		auto f2 = [&](char* p, size_t sz, int64_t from) {
+			return s2.copy(p, sz, size_t(from));
+		};
+		auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+		REQUIRE(idx2.status(idx2["lip__test_replaced/a"]) != nullptr);
+
+		opts.previous = { &idx2, f2 };
+		REQUIRE(archive_to_string(opts, &st, "lip__test_replaced") == s2);
+		REQUIRE(st.unchanged == 2);
+
+		// same size and mtime, another inode
+		struct stat sa;
+		REQUIRE(::stat("lip__test_replaced/a", &sa) == 0);
+		timespec times[2] = { sa.st_atim, sa.st_mtim };
+		REQUIRE(::utimensat(AT_FDCWD, "lip__test_replaced/b", times, 0) ==
+		        0);
+		REQUIRE(::rename("lip__test_replaced/b", "lip__test_replaced/a") ==
+		        0);
+		std::ofstream("lip__test_replaced/b", std::ios::binary) << "new";
+
+		auto s3 = archive_to_string(opts, &st, "lip__test_replaced");
+		auto f3 = [&](char* p, size_t sz, int64_t from) {
+			return s3.copy(p, sz, size_t(from));
+		};
+		auto idx3 = lip::index(f3, int64_t(s3.size()), nullptr);
+		REQUIRE(st.unchanged == 0);
+		REQUIRE(content_of(f3, idx3["lip__test_replaced/a"]) == "new");
+	}
+
+	SUBCASE("append")
+	{
+		std::string large(60 * 1000, 'x');
+		::mkdir("lip__test_append", 0755);
+		std::ofstream("lip__test_append/a", std::ios::binary) << large;
+		std::ofstream("lip__test_append/b", std::ios::binary) << "b";
+		auto fn = "lip__test_append.lip";
+		auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		defer(::close(fd); ::remove(fn); ::remove("lip__test_append/a");
+		      ::remove("lip__test_append/b"); ::remove("lip__test_append/c");
+		      ::rmdir("lip__test_append"));
+
+		lip::archive_stats st;
+		lip::archive(fd, "lip__test_append");
+		auto size = lseek(fd, 0, SEEK_END);
+
+		// unchanged files are not stored again
+		opts.append = true;
+		st = lip::archive(fd, "lip__test_append", opts);
+		REQUIRE(st.unchanged == 2);
+		auto size2 = lseek(fd, 0, SEEK_END);
+		REQUIRE(size2 - size < int64_t(large.size()));
+
+		std::ofstream("lip__test_append/c", std::ios::binary) << "c";
+		st = lip::archive(fd, "lip__test_append", opts);
+		REQUIRE(st.unchanged == 2);
+		REQUIRE(lseek(fd, 0, SEEK_END) - size2 < int64_t(large.size()));
+
+		// a failed append leaves the archive as it was
+		auto size3 = lseek(fd, 0, SEEK_END);
+		REQUIRE_THROWS(lip::archive(fd, "lip__test_append/none", opts));
+		REQUIRE(lseek(fd, 0, SEEK_END) == size3);
+
+		auto f2 = vvpkg::from_seekable_descriptor(fd);
+		lip::index idx2(fd);
+		REQUIRE(idx2.size() == 4);
+		REQUIRE(content_of(f2, idx2["lip__test_append/a"]) == large);
+		REQUIRE(content_of(f2, idx2["lip__test_append/b"]) == "b");
+		REQUIRE(content_of(f2, idx2["lip__test_append/c"]) == "c");
+	}
+
+	SUBCASE("parallel walk of many directories")
+	{
+		::mkdir("lip__test_dirs", 0755);
+		std::vector<std::string> dirs;
+		for (int i = 0; i < 10; ++i)
+		{
+			auto d = "lip__test_dirs/" + std::to_string(i);
+			::mkdir(d.data(), 0755);
+			for (int j = 0; j < 60; ++j)
+			{
+				dirs.push_back(d + "/" + std::to_string(j));
+				::mkdir(dirs.back().data(), 0755);
+			}
+			dirs.push_back(d);
+		}
+		dirs.push_back("lip__test_dirs");
+		defer(for (auto& d : dirs) ::rmdir(d.data()));
+
+		opts.walkers = 0;
+		auto s2 = archive_to_string(opts, nullptr, "lip__test_dirs");
+
+		struct rlimit rl;
+		REQUIRE(::getrlimit(RLIMIT_NOFILE, &rl) == 0);
+		auto saved = rl;
+		rl.rlim_cur = 200;
+		REQUIRE(::setrlimit(RLIMIT_NOFILE, &rl) == 0);
+		defer(::setrlimit(RLIMIT_NOFILE, &saved));
+		for (int n : { 2, 4 })
+		{
+			opts.walkers = n;
+			REQUIRE(archive_to_string(opts, nullptr,
+			                          "lip__test_dirs") == s2);
+		}
+	}
+
+	SUBCASE("sparse files")
+	{
+		constexpr int64_t size = 16 * 1024 * 1024;
+		::mkdir("lip__test_sparse", 0755);
+		auto fd = ::open("lip__test_sparse/big", O_WRONLY | O_CREAT, 0644);
+		REQUIRE(fd != -1);
+		REQUIRE(::ftruncate(fd, size) == 0);
+		REQUIRE(::pwrite(fd, "hello", 5, 1024 * 1024) == 5);
+		REQUIRE(::pwrite(fd, "world", 5, size - 5) == 5);
+		::close(fd);
+		defer(::remove("lip__test_sparse/big");
+		      ::remove("lip__test_sparse"));
+
+		auto s2 = archive_to_string(opts, nullptr, "lip__test_sparse");
+		auto f2 = [&](char* p, size_t sz, int64_t from) {
+			return s2.copy(p, sz, size_t(from));
+		};
+		auto idx2 = lip::index(f2, int64_t(s2.size()), nullptr);
+		auto& fc = idx2["lip__test_sparse/big"];
+		if (!fc.is_sparse())
+			return;  // the file system does not report holes
+
+		REQUIRE(s2.size() < size / 8);
+		REQUIRE(fc.size() == size);
+
+		auto x = content_of(f2, fc);
+		REQUIRE(x.size() == size_t(size));
+		REQUIRE(x.compare(1024 * 1024, 5, "hello") == 0);
+		REQUIRE(x.compare(size_t(size - 5), 5, "world") == 0);
+		REQUIRE(std::count(x.begin(), x.end(), '\0') == size - 10);
+		// of the content, however it is laid out
+		REQUIRE(fc.info.digest ==
+		        stdex::hashlib::blake2b_224(x).digest());
+
+		char fn[] = "lip__test_sparse.tmp";
+		auto out = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(out != -1);
+		defer(::close(out); ::remove(fn));
+		lip::content(f2).extract(fc, out);
+
+		struct stat st;
+		REQUIRE(::fstat(out, &st) == 0);
+		REQUIRE(st.st_size == size);
+		REQUIRE(st.st_blocks * 512 < size / 8);
+		std::string y(x.size(), '\1');
+		REQUIRE(::pread(out, &y[0], y.size(), 0) == ssize_t(y.size()));
+		REQUIRE(y == x);
+	}
+#endif
+}
@@ -56,7 +56,7 @@ TEST_CASE("content")
 		REQUIRE_THROWS_AS(lip::content(f).retrieve(fc),
 		                  std::invalid_argument);
 
-		size_t total;
+		size_t total = 0;
 		lip::content(f).copy(fc, [&](char const* p, size_t sz) {
 			total += sz;
 			return sz;
@@ -2,9 +2,13 @@
 #include "testdata.h"
 
 #include <lip/lip.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <vvpkg/c_file_funcs.h>
 #include <vvpkg/fd_funcs.h>
 #include <stdex/defer.h>
+#include <fcntl.h>
 
 #ifdef _WIN32
 #define U(s) L##s
@@ -14,6 +18,53 @@
 
 using namespace stdex::literals;
 
+// an archive of the entries added by add(pk), written in memory
+template <class F>
+static std::string pack(lip::packer_options opts, F&& add)
+{
+	std::string s;
+	lip::packer pk(opts);
+	pk.start([&](char const* p, size_t sz) {
+		s.append(p, sz);
+		return sz;
+	});
+	add(pk);
+	pk.finish();
+	return s;
+}
+
+static lip::index index_of(std::string const& s)
+{
+	return lip::index(
+	    [&](char* p, size_t sz, int64_t from) {
+		    return s.copy(p, sz, size_t(from));
+	    },
+	    int64_t(s.size()), nullptr);
+}
+
+// the same entries without and with the sections that on(opts) adds
+struct section_case
+{
+	std::string s1, s2;
+	lip::index idx1, idx2;
+};
+
+template <class F, class G>
+static section_case without_and_with(F&& add, G&& on)
+{
+	lip::packer_options opts;
+	auto s1 = pack(opts, add);
+	on(opts);
+	auto s2 = pack(opts, add);
+	// spilled runs give the same archive
+	opts.memory_budget = 16 * 1024;
+	REQUIRE(pack(opts, add) == s2);
+
+	auto idx1 = index_of(s1), idx2 = index_of(s2);
+	return { std::move(s1), std::move(s2), std::move(idx1),
+		 std::move(idx2) };
+}
+
 TEST_CASE("index")
 {
 	std::string s;
@@ -78,6 +129,283 @@ TEST_CASE("index")
 		REQUIRE(it->size() == 5);
 	}
 
+	SUBCASE("by name")
+	{
+		auto t = lip::archive_clock::now();
+		char const* names[] = { "r1",     "r1/a",   "r1/b",
+			                "r1/b/a", "r2",     "r2/a",
+			                "r2/c",   "r3/b/a", "r3/d" };
+		for (auto name : names)
+			pk.add_directory(name, t, 0, 0, 0, 0);
+		pk.finish();
+		auto const idx = lip::index(f, int64_t(s.size()), nullptr);
+
+		char const* queries[] = { "x/a",    "x/b/a", "r9/c", "x/d",
+			                  "x/e",    "x/b",   "r1/",  "x/",
+			                  "q/b/a/", "r3/b/a", "r3",  "x/yd" };
+
+		// the first calls may come from several threads at once
+		std::vector<lip::index::iterator> found[4];
+		std::vector<std::thread> threads;
+		for (auto& v : found)
+			threads.emplace_back([&] {
+				for (auto q : queries)
+					v.push_back(idx.find_by_name(q));
+			});
+		for (auto& th : threads)
+			th.join();
+		for (auto& v : found)
+			REQUIRE(v == found[0]);
+
+		for (size_t i = 0; i < found[0].size(); ++i)
+		{
+			auto q = queries[i];
+			auto expected = std::find_if(
+			    idx.begin(), idx.end(), [&](lip::fcard const& fc) {
+				    return lip::removeDirName(idx.name(fc)) ==
+				           lip::removeDirName(q);
+			    });
+			REQUIRE(idx.find_by_name(q) == expected);
+			REQUIRE(found[0][i] == expected);
+		}
+		REQUIRE(idx.find_by_name("r3/d") != idx.end());
+		REQUIRE(idx.find_by_name("x/yd") == idx.end());
+	}
+
+	SUBCASE("children")
+	{
+		auto t = lip::archive_clock::now();
+		char const* dirs[] = { "d", "d/a", "d/a/x", "f", "f/g" };
+		char const* files[] = { "d-x",     "d/a.b", "d/a/x/y", "d/a/z",
+			                "d/b",     "d0",    "e/o/x",   "e/p",
+			                "e/p/q",   "f/g/h/i", "top" };
+		auto c = without_and_with(
+		    [&](lip::packer& pk) {
+			    for (auto name : dirs)
+				    pk.add_directory(name, t, 0, 0, 0, 0);
+			    for (auto name : files)
+				    pk.add_symlink(name, t, name, 0, 0, 0, 0);
+		    },
+		    [](lip::packer_options& opts) { opts.child_table = true; });
+		auto &idx1 = c.idx1, &idx2 = c.idx2;
+		REQUIRE(c.s2.size() > c.s1.size());
+
+		auto list = [](lip::index const& idx, char const* dir) {
+			std::string r;
+			for (auto&& fc : idx.children(dir))
+				r.append(idx.name(fc)).append(" ");
+			return r;
+		};
+		REQUIRE(list(idx1, "") == "d d-x d0 f top ");
+		REQUIRE(list(idx1, "d") == "d/a d/a.b d/b ");
+		REQUIRE(list(idx1, "d/a") == "d/a/x d/a/z ");
+		REQUIRE(list(idx1, "e") == "e/p ");
+		REQUIRE(list(idx1, "e/p") == "e/p/q ");
+		REQUIRE(list(idx1, "f/g") == "");
+		REQUIRE(list(idx1, "top") == "");
+		REQUIRE(list(idx1, "none") == "");
+
+		// entries under a symlink are listed by name in both
+		char const* queries[] = { "",    "d",   "d/a", "d/a/x",
+			                  "e",   "e/o", "e/p", "f",
+			                  "f/g", "top", "none" };
+		for (auto q : queries)
+		{
+			auto r1 = list(idx1, q), r2 = list(idx2, q);
+			REQUIRE(r1 == r2);
+		}
+		REQUIRE(idx2.children("").size() == 5);
+
+		auto r = idx2.subtree("d");
+		REQUIRE(r.second - r.first == 6);
+		REQUIRE(r.first == idx2.find("d/a"_sv));
+		REQUIRE(idx2.name(r.second[-1]) == "d/b"_sv);
+		r = idx2.subtree("f/g/h");
+		REQUIRE(r.second - r.first == 1);
+		r = idx2.subtree("d0");
+		REQUIRE(r.first == r.second);
+		r = idx2.subtree("");
+		REQUIRE(r.second - r.first == idx2.size());
+	}
+
+	SUBCASE("by digest")
+	{
+		auto t = lip::archive_clock::now();
+		auto c = without_and_with(
+		    [&](lip::packer& pk) {
+			    for (int i = 0; i < 3000; ++i)
+			    {
+				    auto name = std::to_string(i);
+				    auto content = std::to_string(i % 1000);
+				    if (i % 10 == 0)
+					    pk.add_directory(name, t, 0, 0, 0, 0);
+				    else if (i % 10 == 1)
+					    pk.add_symlink(name, t, content, 0, 0, 0,
+					                   0);
+				    else
+					    pk.add_regular_file(
+					        name, t, 0, 0, 0, 0,
+					        [&, done = false](
+					            char* p, size_t sz,
+					            std::error_code&) mutable {
+						        if (done)
+							        return size_t(0);
+						        done = true;
+						        return content.copy(p, sz);
+					        },
+					        i % 3 ? lip::feature{}
+					              : lip::feature::lz4_compressed);
+			    }
+		    },
+		    [](lip::packer_options& opts) { opts.digest_order = true; });
+		auto &idx1 = c.idx1, &idx2 = c.idx2;
+
+		auto list = [](lip::index const& idx, lip::fhash const& d) {
+			std::vector<lip::fcard const*> v;
+			for (auto&& fc : idx.find_by_digest(d))
+				v.push_back(&fc);
+			return v;
+		};
+		for (int i = 0; i < idx1.size(); ++i)
+		{
+			auto d = idx1.digest(idx1[i]);
+			if (d == nullptr)
+				continue;
+			auto v1 = list(idx1, *d), v2 = list(idx2, *d);
+			REQUIRE(v1.size() >= 2);
+			REQUIRE(std::find(v1.begin(), v1.end(), &idx1[i]) !=
+			        v1.end());
+			REQUIRE(v2.size() == v1.size());
+			for (size_t j = 0; j < v1.size(); ++j)
+				REQUIRE(v2[j] - idx2.begin() ==
+				        v1[j] - idx1.begin());
+		}
+
+		lip::fhash none = {}, last;
+		last.fill(0xff);
+		REQUIRE(idx2.find_by_digest(none).empty());
+		REQUIRE(idx2.find_by_digest(last).empty());
+		REQUIRE(idx1.find_by_digest(last).empty());
+	}
+
+	SUBCASE("name table")
+	{
+		auto t = lip::archive_clock::now();
+		auto add = [&](lip::packer& pk) {
+			for (int i = 0; i < 1000; ++i)
+			{
+				auto name = "d" + std::to_string(i % 7) + "/" +
+				            std::to_string(i);
+				if (i % 3 == 0)
+					pk.add_directory(name, t, 0, 0, 0, 0);
+				else
+					pk.add_regular_file(
+					    name, t, 0, 0, 0, 0,
+					    [&, done = false](
+					        char* p, size_t sz,
+					        std::error_code&) mutable {
+						    if (done)
+							    return size_t(0);
+						    done = true;
+						    return name.copy(p, sz);
+					    },
+					    i % 2 ? lip::feature{}
+					          : lip::feature::lz4_compressed);
+			}
+		};
+
+		auto c = without_and_with(
+		    add, [](lip::packer_options& opts) { opts.name_table = true; });
+		auto &idx1 = c.idx1, &idx2 = c.idx2;
+		REQUIRE(idx2.size() == idx1.size());
+		for (int i = 0; i < idx1.size(); ++i)
+		{
+			auto name = idx1.name(idx1[i]);
+			REQUIRE(idx2.find(name) == &idx2[i]);
+			REQUIRE(idx1.find(name) == &idx1[i]);
+			auto d = idx1.digest(idx1[i]);
+			if (d)
+				REQUIRE(*idx2.digest(idx2[i]) == *d);
+		}
+		REQUIRE(idx2.find("d0"_sv) == idx2.end());
+		REQUIRE(idx2.find(""_sv) == idx2.end());
+		REQUIRE(idx2.find("d1/10000"_sv) == idx2.end());
+
+		auto c3 = without_and_with(add, [](lip::packer_options& opts) {
+			opts.name_filter = true;
+		});
+		auto c4 = without_and_with(add, [](lip::packer_options& opts) {
+			opts.name_table = true;
+			opts.name_filter = true;
+		});
+		auto &idx3 = c3.idx2, &idx4 = c4.idx2;
+		for (int i = 0; i < idx1.size(); ++i)
+		{
+			auto name = idx1.name(idx1[i]);
+			REQUIRE(idx3.may_contain(name));
+			REQUIRE(idx3.find(name) == &idx3[i]);
+			REQUIRE(idx4.find(name) == &idx4[i]);
+		}
+		REQUIRE(idx1.may_contain("d1/10000"_sv));
+		REQUIRE(idx3.find("d0"_sv) == idx3.end());
+		REQUIRE(idx4.find("d1/10000"_sv) == idx4.end());
+
+		int passed = 0;
+		for (int i = 1000; i < 11000; ++i)
+		{
+			auto name = "d" + std::to_string(i % 7) + "/" +
+			            std::to_string(i);
+			passed += idx3.may_contain(name);
+			REQUIRE(idx3.find(name) == idx3.end());
+			REQUIRE(idx4.find(name) == idx4.end());
+		}
+		REQUIRE(passed < 300);
+	}
+
+	SUBCASE("search tree")
+	{
+		auto t = lip::archive_clock::now();
+		auto name_of = [](int i) {
+			switch (i % 4)
+			{
+			case 0: return std::to_string(i);
+			case 1: return "common/prefix/" + std::to_string(i);
+			case 2: return "abcdefghijk" + std::to_string(i % 10);
+			default: return "ab/" + std::to_string(i) + "/c";
+			}
+		};
+		for (int n : { 1, 2, 7, 8, 1000 })
+		{
+			auto c = without_and_with(
+			    [&](lip::packer& pk) {
+				    for (int i = 0; i < n; ++i)
+					    pk.add_symlink(name_of(i), t, "x", 0, 0,
+					                   0, 0);
+			    },
+			    [](lip::packer_options& opts) {
+				    opts.search_tree = true;
+			    });
+			auto &idx1 = c.idx1, &idx2 = c.idx2;
+			REQUIRE(idx2.size() == idx1.size());
+			for (int i = 0; i < idx1.size(); ++i)
+				REQUIRE(idx2.find(idx1.name(idx1[i])) == &idx2[i]);
+
+			char const* absent[] = { "",         "0/",      "a",
+				                 "abcdefghij", "abcdefghijk",
+				                 "abcdefghijkz", "common",
+				                 "common/prefix/", "zzz" };
+			for (auto q : absent)
+				REQUIRE(idx2.find(lip::string_view(q)) ==
+				        idx2.end());
+			for (int i = n; i < n + 100; ++i)
+			{
+				auto q = name_of(i);
+				REQUIRE((idx2.find(q) == idx2.end()) ==
+				        (idx1.find(q) == idx1.end()));
+			}
+		}
+	}
+
 	SUBCASE("real files")
 	{
 		char fn[] = "lip__test_index.tmp";
@@ -113,4 +441,42 @@ TEST_CASE("index")
 
 		::remove(fn);
 	}
+
+	SUBCASE("mapped")
+	{
+		char fn[] = "lip__test_index.tmp";
+		auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		REQUIRE(fd != -1);
+		defer(vvpkg::xclose(fd); ::remove(fn));
+		lip::archive_options opts;
+		opts.feat = lip::feature::lz4_compressed;
+		lip::archive(fd, U("3rdparty"), opts);
+
+		lip::ptr p1[2], p2[2];
+		auto idx = lip::index(vvpkg::from_seekable_descriptor(fd),
+		                      vvpkg::xfstat(fd).st_size, p1);
+		auto mapped = lip::index(fd, p2);
+
+		REQUIRE(p1[0].offset == p2[0].offset);
+		REQUIRE(p1[1].offset == p2[1].offset);
+		REQUIRE(mapped.size() == idx.size());
+		for (int i = 0; i < idx.size(); ++i)
+		{
+			REQUIRE(lip::string_view(mapped.name(mapped[i])) ==
+			        idx[i].arcname);
+			REQUIRE(idx.name(idx[i]) == idx[i].arcname);
+			REQUIRE(mapped[i].begin.offset == idx[i].begin.offset);
+			REQUIRE(mapped.find(idx.name(idx[i])) == &mapped[i]);
+			auto d = idx.digest(idx[i]);
+			if (d)
+				REQUIRE(*mapped.digest(mapped[i]) == *d);
+			else
+				REQUIRE(mapped.digest(mapped[i]) == nullptr);
+		}
+
+		auto it = mapped.find("3rdparty/include/cedar/COPYING"_sv);
+		REQUIRE(it != mapped.end());
+		REQUIRE(it->size() == 1311);
+		REQUIRE(mapped.digest(*it) != nullptr);
+	}
 }
@@ -3,9 +3,15 @@
 
 #include <lip/lip.h>
 
+#include <algorithm>
 #include <new>
+#include <vector>
 #include <string.h>
 #include <stdex/hashlib.h>
+#include <stdex/defer.h>
+#include <lz4.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace stdex::literals;
 using stdex::hashlib::hexlify;
@@ -50,7 +56,7 @@ TEST_CASE("packer")
 		bssp->adjust(p.get());
 
 		REQUIRE(indexp->pointer_to<lip::fcard>() == dir);
-		REQUIRE(bssp->pointer_to<char>() == (p.get() + 8));
+		REQUIRE(bssp->pointer_to<char>() == (p.get() + 16));
 
 		auto contentof = [](lip::fcard const& fc) {
 			return std::string(fc.begin.pointer_to<char>(),
@@ -93,7 +99,7 @@ TEST_CASE("packer")
 		lip::ptr last[2];
 		memcpy(last, &*s.begin() + s.size() - 16, 16);
 		REQUIRE(last[0].offset == 70032);
-		REQUIRE(last[1].offset == 70008);
+		REQUIRE(last[1].offset == 70016);
 
 		std::unique_ptr<char[]> p{
 			new char[s.size() - size_t(last[1].offset)]
@@ -122,14 +128,14 @@ TEST_CASE("packer")
 		THEN("move constructible")
 		{
 			pk2.finish();
-			REQUIRE(s.size() == 32 + 64);
+			REQUIRE(s.size() == 32 + sizeof(lip::fcard));
 		}
 
 		THEN("move assignable")
 		{
 			pk = std::move(pk2);
 			pk.finish();
-			REQUIRE(s.size() == 32 + 64);
+			REQUIRE(s.size() == 32 + sizeof(lip::fcard));
 		}
 	}
 
@@ -141,3 +147,494 @@ TEST_CASE("packer")
 		REQUIRE(s[8] == s[16]);
 	}
 }
+
+TEST_CASE("packer dedup")
+{
+	lip::packer_options opts;
+	opts.dedup = true;
+	lip::packer pk(opts);
+
+	auto fn = "lip__test_dedup.tmp";
+	auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	defer(::close(fd); ::remove(fn));
+	pk.start(fd);
+
+	std::string small = "../tmp";
+	std::string large(5 * 1024 * 1024, 'x');
+	auto from = [](std::string const& x) {
+		return [&x, n = size_t(0)](char* p, size_t sz,
+		                           std::error_code&) mutable {
+			auto r = x.copy(p, sz, n);
+			n += r;
+			return r;
+		};
+	};
+
+	pk.add_symlink("a", lip::archive_clock::now(), small, 0, 0, 0, 0);
+	pk.add_regular_file("b", lip::archive_clock::now(), 0, 0, 0, 0,
+	                    from(small));
+	pk.add_regular_file("c", lip::archive_clock::now(), 0, 0, 0, 0,
+	                    from(large));
+	pk.add_regular_file("d", lip::archive_clock::now(), 0, 0, 0, 0,
+	                    from(large));
+	pk.add_regular_file("e", lip::archive_clock::now(), 0, 0, 0, 0,
+	                    from(small), lip::feature::lz4_compressed);
+	pk.finish();
+
+	auto st = pk.stats();
+	REQUIRE(st.bytes_deduplicated == int64_t(small.size() + large.size()));
+
+	auto sz = ::lseek(fd, 0, SEEK_END);
+	REQUIRE(sz < int64_t(2 * large.size()));
+	auto f = [&](char* p, size_t n, int64_t off) {
+		return size_t(::pread(fd, p, n, off));
+	};
+	auto idx = lip::index(f, sz, nullptr);
+	REQUIRE(idx.size() == 5);
+	REQUIRE(idx["a"].begin.offset == idx["b"].begin.offset);
+	REQUIRE(idx["c"].begin.offset == idx["d"].begin.offset);
+	REQUIRE(idx["d"].size() == int64_t(large.size()));
+	REQUIRE(idx["e"].begin.offset != idx["a"].begin.offset);
+
+	std::string s;
+	lip::content(f).copy(idx["d"], [&](char const* p, size_t n) {
+		s.append(p, n);
+		return n;
+	});
+	REQUIRE(s == large);
+	REQUIRE(lip::content(f).retrieve(idx["b"]) == small);
+	REQUIRE(idx["e"].size() == int64_t(small.size()));
+	REQUIRE(lip::content(f).retrieve(idx["e"]) == small);
+}
+
+TEST_CASE("packer lz4 blocks")
+{
+	std::string input;
+	for (int i = 0; input.size() < 1500000; ++i)
+		input += std::to_string(i * i) + ' ';
+
+	auto pack = [&](int jobs) {
+		lip::packer_options opts;
+		opts.jobs = jobs;
+		lip::packer pk(opts);
+		std::string s;
+		pk.start([&](char const* p, size_t sz) {
+			s.append(p, sz);
+			return sz;
+		});
+		size_t n = 0;
+		pk.add_regular_file(
+		    "a", lip::archive_clock::time_point{}, 0, 0, 0, 0,
+		    [&](char* p, size_t sz, std::error_code&) {
+			    auto r = input.copy(p, std::min<size_t>(sz, 1000), n);
+			    n += r;
+			    return r;
+		    },
+		    lip::feature::lz4_compressed | lip::feature::lz4_blocks);
+		pk.finish();
+		return s;
+	};
+
+	auto s = pack(0);
+	REQUIRE(pack(2) == s);
+
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s.copy(p, sz, size_t(from));
+	};
+	auto idx = lip::index(f, int64_t(s.size()), nullptr);
+	auto& fc = idx["a"];
+	REQUIRE(fc.is_lz4_compressed());
+	REQUIRE(fc.has_lz4_blocks());
+	REQUIRE(fc.size() == int64_t(input.size()));
+
+	// the table at the end locates every block
+	auto data = s.substr(size_t(fc.begin.offset), size_t(fc.stored_size()));
+	int64_t n;
+	memcpy(&n, &data[data.size() - sizeof(n)], sizeof(n));
+	REQUIRE(n == int64_t((input.size() + 65535) / 65536));
+	std::vector<int64_t> offsets(static_cast<size_t>(n));
+	memcpy(offsets.data(), &data[data.size() - sizeof(n) * size_t(n + 1)],
+	       sizeof(n) * size_t(n));
+
+	for (int64_t i = n - 1; i >= 0; --i)
+	{
+		int csize;
+		memcpy(&csize, &data[size_t(offsets[size_t(i)])], sizeof(csize));
+		char out[65536];
+		auto sz = LZ4_decompress_safe(
+		    &data[size_t(offsets[size_t(i)]) + sizeof(csize)], out,
+		    csize, int(sizeof(out)));
+		REQUIRE(input.compare(size_t(i) * sizeof(out), size_t(sz), out,
+		                      size_t(sz)) == 0);
+	}
+}
+
+TEST_CASE("packer output buffer")
+{
+	auto t = lip::archive_clock::now();
+	std::string large(300 * 1000, 'x');
+	auto pack = [&](lip::packer& pk) {
+		for (int i = 0; i < 100; ++i)
+			pk.add_symlink("link" + std::to_string(i), t, "../tmp",
+			               0, 0, 0, 0);
+		pk.add_regular_file(
+		    "large", t, 0, 0, 0, 0,
+		    [&, n = size_t(0)](char* p, size_t sz,
+		                       std::error_code&) mutable {
+			    auto r = large.copy(p, sz, n);
+			    n += r;
+			    return r;
+		    });
+		pk.finish();
+	};
+	auto to_string = [&](size_t buffer_size, int* calls) {
+		lip::packer_options opts;
+		opts.buffer_size = buffer_size;
+		lip::packer pk(opts);
+		std::string s;
+		pk.start([&](char const* p, size_t sz) {
+			++*calls;
+			s.append(p, sz);
+			return sz;
+		});
+		pack(pk);
+		auto st = pk.stats();
+		REQUIRE(st.bytes_written == int64_t(s.size()));
+		REQUIRE(st.flushes == *calls);
+		return s;
+	};
+
+	int unbuffered = 0, small = 0, large_buffer = 0;
+	auto s = to_string(0, &unbuffered);
+	REQUIRE(to_string(4096, &small) == s);
+	REQUIRE(to_string(1024 * 1024, &large_buffer) == s);
+	REQUIRE(small < unbuffered);
+	REQUIRE(large_buffer == 2);  // the header and the rest
+
+	lip::packer_options opts;
+	opts.buffer_size = 4096;
+	lip::packer pk(opts);
+	auto fn = "lip__test_buffer.tmp";
+	auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	defer(::close(fd); ::remove(fn));
+	pk.start(fd);
+	pack(pk);
+
+	std::string y(s.size() + 1, '\0');
+	REQUIRE(::pread(fd, &y[0], y.size(), 0) == ssize_t(s.size()));
+	y.pop_back();
+	REQUIRE(y == s);
+}
+
+TEST_CASE("packer direct output")
+{
+	auto t = lip::archive_clock::now();
+	std::string large(300 * 1000, 'x');
+	auto pack = [&](lip::packer& pk) {
+		pk.add_symlink("a", t, "../tmp", 0, 0, 0, 0);
+		pk.add_regular_file(
+		    "b", t, 0, 0, 0, 0,
+		    [&, n = size_t(0)](char* p, size_t sz,
+		                       std::error_code&) mutable {
+			    auto r = large.copy(p, sz, n);
+			    n += r;
+			    return r;
+		    });
+		pk.finish();
+	};
+
+	std::string s;
+	lip::packer pk;
+	pk.start([&](char const* p, size_t sz) {
+		s.append(p, sz);
+		return sz;
+	});
+	pack(pk);
+
+	lip::packer_options opts;
+	opts.direct_io = true;
+	opts.buffer_size = 10000;
+	lip::packer pk2(opts);
+	REQUIRE_THROWS_AS(pk2.start([](char const*, size_t sz) { return sz; }),
+	                  std::invalid_argument);
+
+	auto fn = "lip__test_direct.tmp";
+	auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	defer(::close(fd); ::remove(fn));
+	pk2.start(fd);
+	pack(pk2);
+
+	auto st = pk2.stats();
+	REQUIRE(st.bytes_written == int64_t(s.size()));
+	REQUIRE(::lseek(fd, 0, SEEK_END) == int64_t(s.size()));
+	// the descriptor reads only into aligned buffers
+	auto rd = ::open(fn, O_RDONLY);
+	REQUIRE(rd != -1);
+	defer(::close(rd));
+	std::string y(s.size(), '\0');
+	REQUIRE(::pread(rd, &y[0], y.size(), 0) == ssize_t(s.size()));
+	REQUIRE(y == s);
+}
+
+TEST_CASE("packer name order")
+{
+	std::string s;
+	lip::packer_options opts;
+	opts.jobs = 2;
+	lip::packer pk(opts);
+	pk.start([&](char const* p, size_t sz) {
+		s.append(p, sz);
+		return sz;
+	});
+
+	auto t = lip::archive_clock::now();
+	std::vector<std::string> names = { "b",  "\xc3\xa9", "a/b", "ab",
+		                           "a-", "a",        "\x7f" };
+	for (int i = 0; i < 300; ++i)
+		names.push_back("long/common/prefix/" + std::to_string(i * 7919));
+	for (auto& name : names)
+		pk.add_symlink(name, t, "old", 0, 0, 0, 0);
+	pk.add_symlink("a", t, "new", 0, 0, 0, 0);
+	pk.finish();
+
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s.copy(p, sz, size_t(from));
+	};
+	auto idx = lip::index(f, int64_t(s.size()), nullptr);
+	std::sort(names.begin(), names.end());
+	REQUIRE(idx.size() == int(names.size()));
+	for (int i = 0; i < idx.size(); ++i)
+		REQUIRE(idx[i].arcname == names[size_t(i)]);
+	REQUIRE(lip::content(f).retrieve(idx["a"]) == "new");
+}
+
+TEST_CASE("packer memory budget")
+{
+	auto t = lip::archive_clock::now();
+	auto pack = [&](size_t budget) {
+		std::string s;
+		lip::packer_options opts;
+		opts.memory_budget = budget;
+		lip::packer pk(opts);
+		pk.start([&](char const* p, size_t sz) {
+			s.append(p, sz);
+			return sz;
+		});
+
+		for (int i = 0; i < 2000; ++i)
+		{
+			auto name = std::to_string(i * 7919 % 2000);
+			auto content = "content " + name;
+			pk.add_regular_file(
+			    "f/" + name, t, 0, 0, 0, 0,
+			    [&, n = size_t(0)](char* p, size_t sz,
+			                       std::error_code&) mutable {
+				    auto r = content.copy(p, sz, n);
+				    n += r;
+				    return r;
+			    },
+			    i % 3 ? lip::feature{} : lip::feature::lz4_compressed);
+			if (i % 10 == 0)
+				pk.add_symlink("s/" + name, t, name, 0, 0, 0, 0);
+		}
+		pk.add_symlink("s/0", t, "replaced", 0, 0, 0, 0);
+		pk.add_hardlink("h/0", "f/0", t, 0, 0, 0, 0);
+		pk.add_hardlink("h/1", "f/1", t, 0, 0, 0, 0);
+		pk.finish();
+		return s;
+	};
+
+	auto s = pack(0);
+	REQUIRE(pack(16 * 1024) == s);
+
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s.copy(p, sz, size_t(from));
+	};
+	auto idx = lip::index(f, int64_t(s.size()), nullptr);
+	REQUIRE(idx.size() == 2000 + 200 + 2);
+	REQUIRE(lip::content(f).retrieve(idx["s/0"]) == "replaced");
+	REQUIRE(lip::content(f).retrieve(idx["h/0"]) == "content 0");
+	REQUIRE(idx.digest(idx["h/0"]) != nullptr);
+	REQUIRE(*idx.digest(idx["h/0"]) == *idx.digest(idx["f/0"]));
+}
+
+TEST_CASE("packer append")
+{
+	auto t = lip::archive_clock::now();
+	std::string large(60 * 1000, 'x');
+	auto add = [&](lip::packer& pk, char const* name,
+	               std::string const& content,
+	               lip::feature feat = {}) {
+		pk.add_regular_file(
+		    name, t, 0, 0, 0, 0,
+		    [&, n = size_t(0)](char* p, size_t sz,
+		                       std::error_code&) mutable {
+			    auto r = content.copy(p, sz, n);
+			    n += r;
+			    return r;
+		    },
+		    feat);
+	};
+
+	auto fn = "lip__test_append.tmp";
+	auto fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd != -1);
+	defer(::close(fd); ::remove(fn));
+
+	std::string old_b = "old b", e = "compressed e", new_b = "new b",
+	            c = "compressed c";
+	{
+		lip::packer pk;
+		pk.start(fd);
+		add(pk, "a", large);
+		add(pk, "b", old_b);
+		add(pk, "e", e, lip::feature::lz4_compressed);
+		pk.finish();
+	}
+
+	auto read_all = [&] {
+		std::string s(size_t(lseek(fd, 0, SEEK_END)), '\0');
+		REQUIRE(::pread(fd, &s[0], s.size(), 0) == ssize_t(s.size()));
+		return s;
+	};
+	auto s = read_all();
+
+	auto null = ::open("/dev/null", O_RDONLY);
+	REQUIRE(null != -1);
+	defer(::close(null));
+	lip::packer pk;
+	REQUIRE_THROWS_AS(pk.resume(null), std::runtime_error);
+
+	pk.resume(fd);
+	add(pk, "b", new_b);
+	add(pk, "c", c, lip::feature::lz4_compressed);
+	pk.add_hardlink("d", "a", t, 0, 0, 0, 0);
+	pk.finish();
+
+	auto s2 = read_all();
+	REQUIRE(pk.stats().bytes_written < int64_t(large.size()));
+	// the old archive is left whole ahead of the new data
+	REQUIRE(s2.compare(0, s.size(), s) == 0);
+
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s2.copy(p, sz, size_t(from));
+	};
+	auto idx = lip::index(f, int64_t(s2.size()), nullptr);
+	REQUIRE(idx.size() == 5);
+	REQUIRE(lip::content(f).retrieve(idx["a"]) == large);
+	REQUIRE(lip::content(f).retrieve(idx["b"]) == new_b);
+	REQUIRE(lip::content(f).retrieve(idx["c"]) == c);
+	REQUIRE(lip::content(f).retrieve(idx["d"]) == large);
+	REQUIRE(lip::content(f).retrieve(idx["e"]) == e);
+	REQUIRE(idx.digest(idx["c"]) != nullptr);
+	REQUIRE(*idx.digest(idx["e"]) ==
+	        stdex::hashlib::blake2b_224(e).digest());
+}
+
+TEST_CASE("packer merge")
+{
+	auto t = lip::archive_clock::now();
+	std::string shared(20 * 1000, 's');
+	auto add = [&](lip::packer& pk, char const* name,
+	               std::string const& content,
+	               lip::feature feat = {}) {
+		pk.add_regular_file(
+		    name, t, 0, 0, 0, 0,
+		    [&, n = size_t(0)](char* p, size_t sz,
+		                       std::error_code&) mutable {
+			    auto r = content.copy(p, sz, n);
+			    n += r;
+			    return r;
+		    },
+		    feat);
+	};
+
+	std::string a = "content a", b1 = "first b", b2 = "second b",
+	            c = "compressed c";
+	auto fn1 = "lip__test_merge1.tmp", fn2 = "lip__test_merge2.tmp",
+	     fn3 = "lip__test_merge3.tmp";
+	auto fd1 = ::open(fn1, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	auto fd2 = ::open(fn2, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	auto fd3 = ::open(fn3, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd1 != -1);
+	REQUIRE(fd2 != -1);
+	REQUIRE(fd3 != -1);
+	defer(::close(fd1); ::remove(fn1); ::close(fd2); ::remove(fn2);
+	      ::close(fd3); ::remove(fn3));
+
+	{
+		lip::packer pk;
+		pk.start(fd1);
+		pk.add_directory("d", t, 0, 0, 0, 0);
+		add(pk, "d/a", a);
+		add(pk, "d/b", b1);
+		add(pk, "d/s", shared);
+		pk.add_hardlink("d/h", "d/a", t, 0, 0, 0, 0);
+		pk.finish();
+	}
+	{
+		lip::packer pk;
+		pk.start(fd2);
+		add(pk, "d/b", b2);
+		add(pk, "d/c", c, lip::feature::lz4_compressed);
+		add(pk, "e/s", shared);
+		pk.add_symlink("e/l", t, "../d/a", 0, 0, 0, 0);
+		pk.finish();
+	}
+
+	auto read_all = [](int fd) {
+		std::string s(size_t(lseek(fd, 0, SEEK_END)), '\0');
+		REQUIRE(::pread(fd, &s[0], s.size(), 0) == ssize_t(s.size()));
+		return s;
+	};
+	auto s1 = read_all(fd1), s2 = read_all(fd2);
+	auto f1 = [&](char* p, size_t sz, int64_t from) {
+		return s1.copy(p, sz, size_t(from));
+	};
+	auto f2 = [&](char* p, size_t sz, int64_t from) {
+		return s2.copy(p, sz, size_t(from));
+	};
+	lip::index idx1(f1, int64_t(s1.size()), nullptr);
+	lip::index idx2(f2, int64_t(s2.size()), nullptr);
+
+	auto st = lip::merge(fd3, { { &idx1, f1, fd1 }, { &idx2, f2, fd2 } });
+	REQUIRE(st.bytes_deduplicated == int64_t(shared.size()));
+
+	auto s = read_all(fd3);
+	REQUIRE(s.size() < s1.size() + s2.size() - shared.size());
+	auto f = [&](char* p, size_t sz, int64_t from) {
+		return s.copy(p, sz, size_t(from));
+	};
+	lip::index idx(f, int64_t(s.size()), nullptr);
+	REQUIRE(idx.size() == 8);
+	REQUIRE(idx["d"].type() == lip::ftype::is_directory);
+	REQUIRE(lip::content(f).retrieve(idx["d/a"]) == a);
+	REQUIRE(lip::content(f).retrieve(idx["d/h"]) == a);
+	REQUIRE(lip::content(f).retrieve(idx["d/b"]) == b2);
+	REQUIRE(lip::content(f).retrieve(idx["d/c"]) == c);
+	REQUIRE(lip::content(f).retrieve(idx["d/s"]) == shared);
+	REQUIRE(lip::content(f).retrieve(idx["e/l"]) == "../d/a");
+	REQUIRE(idx["e/s"].begin.offset == idx["d/s"].begin.offset);
+	REQUIRE(*idx.digest(idx["d/c"]) == *idx2.digest(idx2["d/c"]));
+
+	// data no entry refers to are left behind
+	std::string s4;
+	lip::packer pk;
+	pk.start([&](char const* p, size_t sz) {
+		s4.append(p, sz);
+		return sz;
+	});
+	pk.add_archive({ &idx, f });
+	pk.finish();
+	REQUIRE(s4.size() <= s.size() - b1.size());
+	auto f4 = [&](char* p, size_t sz, int64_t from) {
+		return s4.copy(p, sz, size_t(from));
+	};
+	lip::index idx4(f4, int64_t(s4.size()), nullptr);
+	REQUIRE(idx4.size() == 8);
+	REQUIRE(lip::content(f4).retrieve(idx4["d/b"]) == b2);
+	REQUIRE(lip::content(f4).retrieve(idx4["d/s"]) == shared);
+}